@@ -0,0 +1,520 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+       http://www.apache.org/licenses/LICENSE-2.0
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// This ATTiny85 program controls the enable pin on the Max1873 so it will safely charge the Li+ laptop battery in a 2, 3 or 4 
+// series pack. The pack settings (number of cells, cell voltages and charge currents) are at the top of the defines
+// below and the ADC levels are worked out from them by the compiler. Setting cells to 3 or 4 also picks that pack's
+// preset, which uses the exact ADC levels the old 3 series and 4 series programs were tested with, and the build
+// stops if a preset is more than a count away from what the settings give. 5 or more cells won't fit the 1.1 volt
+// ADC range with the R18/R19 divider, and the build stops there too.
+// Assumptions: 
+//    a. Maximum battery charge current is set at 1 amp (charge_ma).
+//    b. Battery Pack has 3 series cells (cells), each cell fully charged at 4.2 volts, giving a pack voltage of 12.6 volts.
+//    c. NTC Thermistor resistance in ohms is 13.6K @ 18C, 9.3K @ 27C, 5.3K @ 41C, 3.2K @ 59C
+//       A 10K thermistor with a B value of 3435 fits these to within about 1.5C.
+//    d. Charge current, battery voltage, and Temperature inputs to the ATTiny use the resistor divider values on the schematic. 
+//       These are in the defines too, for a board with different parts.
+// Program Features:
+// 1. The ATTiny keeps track of how long charging has been going on and shuts down the Max1873 after a defined maximum time. 
+// 2. The Pi uses a GPIO pin to send a 3.3 volt logic signal to the ATTiny to turn off charging. 
+//    This should be done if the Pi detects (over the SM Bus) that the battery temperature or voltage has gone too high.
+// 3. The ATTiny ADC reads the battery temperature sensor (10K NTC thermistor) at startup and then while charging to see 
+//    if the temperature rises too much and the Max1873 needs to stop charging. 
+//    The ADC reading is turned into degrees C with a table in flash that the compiler works out from the thermistor
+//    and divider values below. Charging stops above 45C, 10C above the temperature at power up, or if the temperature
+//    rises more than 1C in a minute. It starts again once the temperature is 2C under the limits for 10 seconds.
+//    Every 16 msec the ADC takes turns on the battery voltage, temperature and charge current, and the ADC 
+//    interrupt keeps a moving average of each. The loop reads the averages without waiting, so the temperature
+//    is checked every 16 msec instead of every 5 seconds.
+// 4. The ATTiny ADC reads the battery voltage prior to enabling the charger to see if the battery is ready for a normal charge. 
+//    If the voltage is too low, the routine will pulse the charger enable signal to slowly bring the battery voltage up. 
+//    The pulse duration will increase as the battery voltage rises. Timer1 makes the pulses on the enable pin (OC1A), 
+//    so the loop keeps running while it pulses.
+// 5. The ATTiny ADC reads the charge current from the Iout pin of the Max1873 to see when it has reached trickle
+//    charge levels and then shuts down charging. 
+// 6. Charging is a state machine that the loop steps every 16 msec, and no state waits for anything:
+//      precharge - battery under the precharge level, pulse it for a minute, rest 2 seconds and read it again
+//      charge    - constant current, the Max1873 is on
+//      taper     - constant voltage, the Max1873 is on and the current falls off to the trickle level
+//      cool      - too hot, the Max1873 is off until the battery cools down, then back to charge
+//      done      - the current got down to the trickle level, the Max1873 is off
+//      fault     - too hot while precharging or over the time limit, the Max1873 is off
+//    Every state is checked against the temperature limits and the Pi turnoff input on every pass.
+//
+// Some Dell batteries will need SMBus communication from the Pi before they will accept charge current. 
+// If the ATTiny reads a charge current at or near zero, (meaning the battery is not accepting a charge), 
+// the Max1873 is kept enabled so that when the Pi sends the appropriate commands over the SM Bus, the battery will begin charging.
+//   
+// The ATTiny is powered from the low voltage (5.4V) regulator in the Max1873 which only operates when the 19.5VDC wall supply is  
+// plugged in. This Max1873 regulator can only source 3ma and it meaasures 2.5ma when the ATTiny is running at 1MHz.  
+// Any higher clock frequency will overload the regulator. It will also overload the regulator if the analog input voltages
+// are between 1.5 and 2.5 volts. To avoid this, the internal 1.1 volt ADC reference is used and all analog input 
+// voltages are scaled down to 1.1 volts max. 
+// The digital input buffers on the analog pins are also turned off, and the ATTiny sleeps between jobs instead of
+// spinning in delay(). It is in Power-down (a few uA) except for about 1 msec every 16 msec, when it wakes up on the 
+// watchdog timer and does the ADC conversions in ADC Noise Reduction sleep (the CPU is stopped while the ADC converts,
+// which is quieter too) and then runs the loop. While Timer1 is pulsing it sleeps in Idle instead, which keeps the
+// timer running. A change on the Pi turnoff input also wakes it up, and its interrupt turns the charger off straight
+// away. Time is counted in watchdog ticks, which are only good to about 10%, so the time limit and precharge pulses
+// are that accurate.
+
+// Release History
+// July 1, 2020  Original Release
+// Dec 17, 2020  4 series version, 12.3 volt precharge level and 70ma trickle level
+// Feb 22, 2021  Interrupt driven ADC sampling with moving averages, loop() timed with millis() instead of delays
+// Feb 24, 2021  Sleep between jobs, watchdog timer ticks instead of millis(), pin change interrupt on pi_turnoff
+// Feb 26, 2021  Temperature in degrees C from a thermistor table, absolute and rate of rise limits
+// Feb 28, 2021  One program for the 3 and 4 series packs, ADC levels worked out from the pack settings
+// Mar 2, 2021  Charge state machine, Timer1 precharge pulses, no more hanging in while loops
+// Mar 4, 2021  3 and 4 series presets with the old programs' exact ADC levels, 2 to 4 cells only
+
+#include <avr/sleep.h>
+#include <avr/power.h>
+
+// Pack settings
+#define cells 3 // series cells in the pack, 2, 3 or 4
+#define cell_full 4.2 // fully charged cell volts
+#define cell_cv 4.15 // cell volts at which the Max1873 is taken to be in constant voltage
+#define charge_ma 1000 // Max1873 charge current in ma, set by the parts on the board
+#define no_charge_ma 12 // charge current in ma that counts as "no-charge"
+#if cells == 4 // 4 series pack preset, the levels from the 4 series program
+#define cell_precharge 3.075 // cell volts below which the pack is pulse charged, 12.3 volts
+#define trickle_ma 70 // charge current in ma that ends charging
+#define precharge_preset 673 // ADC levels, 0 = work it out from the settings above. Checked against them below
+#define trickle_preset 65
+#define no_charge_preset 11
+#elif cells == 3 // 3 series pack preset, the levels from the 3 series program
+#define cell_precharge 3.0 // 9 volts
+#define trickle_ma 250
+#define precharge_preset 492
+#define trickle_preset 233
+#define no_charge_preset 11
+#else // no preset, untested
+#define cell_precharge 3.0
+#define trickle_ma 250
+#define precharge_preset 0
+#define trickle_preset 0
+#define no_charge_preset 0
+#endif
+// ATTiny Logic Pins
+#define pi_turnoff 0 // Pin 5 PB0 is an input. 1=turnoff. PCB has external pull down resistor
+#define max_en 1 // Pin 6 PB1 drives BS170 NFET that turns Max1873 on and off. 0=On, 1=Off
+// ATTiny Analog Pins
+#define Vbat A1 // Pin 7 ADC1 receives divided down battery pack voltage
+#define bat_temp A2 // Pin 3 ADC2 receives divided down battery temperature voltage
+#define iout A3 // Pin 2 ADC3 receives divided down Max1873 Iout voltage
+// ADC channels sampled every tick, the ADMUX channel is the number plus 1 (ADC1, ADC2, ADC3)
+#define vbat_ch 0 // battery voltage
+#define temp_ch 1 // battery temperature
+#define iout_ch 2 // charge current
+#define adc_channels 3
+#define adc_per_channel 3 // conversions on a channel each tick, the first one is thrown away
+#define adc_shift 4 // moving average over about 16 samples (2^4), roughly 130 msec
+#define tick_ms 16 // watchdog timer interrupt period in msec
+#define adc_ref 1.1 // ADC reference in volts, the ATTiny's is only good to 10% so all the ADC levels are that accurate
+// Battery voltage divider, R18 from the battery to the Vbat pin and R19 to ground
+#define vbat_top 160000.0 // R18 ohms
+#define vbat_bottom 10000.0 // R19 ohms
+// Charge current, the Max1873 Iout pin is 20 times the voltage on the sense resistor, and R14 and R15 divide it down
+#define sense_ohms 0.2 // R1
+#define iout_gain 20.0 // Max1873 Iout gain
+#define iout_top 7500.0 // R14 ohms
+#define iout_bottom 2490.0 // R15 ohms
+// NTC thermistor, from the 5.4 volt VL regulator through R16 to the thermistor
+#define ntc_r25 10000.0 // thermistor ohms at 25C
+#define ntc_beta 3435.0 // thermistor B value in degrees K
+#define ntc_pullup 82000.0 // R16 ohms
+#define ntc_supply 5.4 // VL volts
+// Battery charging values
+#define temp_max 450 // 45.0C, no charging above this
+#define temp_rise 100 // 10.0C, no charging this far above the temperature at power up
+#define temp_rate 10 // 1.0C, no charging if the temperature goes up more than this in a minute
+#define temp_hysteresis 20 // 2.0C, after a trip the temperature has to be this far under the max and rise limits
+#define max_minutes 300 // maximum charging time in minutes
+#define check_time 5000 // msec between charge current checks
+#define cool_time 10000 // msec the charger stays off after the temperature limits were exceeded
+#define rate_time 60000 // msec over which temp_rate is measured
+#define pulse_time 60000 // msec of precharge pulses before the battery voltage is read again
+#define rest_time 2000 // msec the battery rests before it is read
+#define pulse_period 121 // Timer1 counts in a precharge pulse cycle less one, 122 x 16.4 msec = 2 seconds
+// Charge states
+#define st_precharge 0 // battery below the precharge level, Timer1 pulses the charger
+#define st_charge 1 // constant current, charger on
+#define st_taper 2 // constant voltage, charger on
+#define st_cool 3 // too hot, charger off for now
+#define st_done 4 // charged, charger off for good. This and st_fault don't count charging time
+#define st_fault 5 // something is wrong, charger off for good
+// What the charger enable pin is doing
+#define out_off 0
+#define out_on 1
+#define out_pulse 2
+
+// ADC levels, worked out by the compiler so they cost no more than the numbers they replace
+constexpr int volts_count(double volts) // ADC reading for a battery voltage
+{
+  return (int)(volts * vbat_bottom / (vbat_top + vbat_bottom) * 1024 / adc_ref);
+}
+
+constexpr int ma_count(double ma) // ADC reading for a charge current
+{
+  return (int)(ma / 1000 * sense_ohms * iout_gain * iout_bottom / (iout_top + iout_bottom) * 1024 / adc_ref);
+}
+
+// The presets win over the worked out levels, which truncate a count low (232 for 250ma instead of 233).
+// A preset has to be within a count of its level, so a changed divider, sense resistor or current stops the build
+// instead of quietly using the old level. Change the preset too, or set it to 0.
+constexpr bool near_preset(int preset, int level) // preset is 0 or within a count of level
+{
+  return (preset == 0) || ((preset >= level - 1) && (preset <= level + 1));
+}
+constexpr int precharge = precharge_preset ? precharge_preset : volts_count(cells * cell_precharge); // Pulse charge until voltage is above this level
+constexpr int trickle = trickle_preset ? trickle_preset : ma_count(trickle_ma); // Trickle charge trip level that turns off the charger
+constexpr int no_charge = no_charge_preset ? no_charge_preset : ma_count(no_charge_ma); // Near zero "no-charge" level
+constexpr int cv_level = volts_count(cells * cell_cv); // Constant voltage from here up, 681 for 3 cells
+constexpr int taper = ma_count(charge_ma * 0.9); // Current under 90% of charge_ma means constant voltage, 835 for 1 amp
+static_assert((cells >= 2) && (cells <= 4), "cells has to be 2, 3 or 4");
+static_assert(near_preset(precharge_preset, volts_count(cells * cell_precharge)), "precharge_preset doesn't match the pack and divider settings");
+static_assert(near_preset(trickle_preset, ma_count(trickle_ma)), "trickle_preset doesn't match trickle_ma and the current sense settings");
+static_assert(near_preset(no_charge_preset, ma_count(no_charge_ma)), "no_charge_preset doesn't match no_charge_ma and the current sense settings");
+static_assert(volts_count(cells * cell_full) < 1000, "full pack voltage is over the ADC range, change R18 (vbat_top)");
+static_assert(ma_count(charge_ma) < 1000, "charge current is over the ADC range, change R14 (iout_top)");
+static_assert((no_charge < trickle) && (trickle_ma < charge_ma), "trickle_ma has to be between no_charge_ma and charge_ma");
+
+// Globals
+int pulse_on = 100; // "On" time in msec for precharge, out of a 2 second cycle. This is adjusted based on the battery voltage
+int charge_level; // holds ADC average value from Iout pin of Max1873.  
+int old_charge_level = 750; // holds ADC value from the previous loop
+int temperature; // battery temperature from the 10K NTC thermistor in tenths of a degree C
+int temperature_start; // battery temperature at power up in tenths of a degree C
+int rate_temp; // battery temperature at rate_start
+int battery_voltage; // holds adc average value of battery pack voltage 
+int minute_count = 0; // Minute counter
+unsigned long charge_ms = 0; // msec of charging time not yet counted in minute_count
+unsigned long last_pass; // ticks_ms() at the last loop
+unsigned long next_check; // ticks_ms() when the charge current is checked next
+unsigned long state_start; // ticks_ms() when the state started (or, in st_cool, when it was last too hot)
+unsigned long rate_start; // ticks_ms() when rate_temp was saved
+byte state; // st_ charge state
+// Interrupt globals
+volatile unsigned int adc_avg[adc_channels]; // moving averages, ADC counts times 2^adc_shift
+volatile byte adc_seeded = 0; // bit per channel, set once its average has been started
+volatile byte adc_ch; // channel being converted
+volatile bool adc_discard; // throw the next result away
+volatile bool adc_done; // set by the ADC interrupt
+volatile unsigned long ticks = 0; // watchdog timer interrupts since power up
+volatile byte output = out_off; // what the charger enable pin is doing, the Pi turnoff interrupt can turn it off
+
+// Interrupt runs after each ADC conversion and wakes the CPU from ADC Noise Reduction sleep
+ISR(ADC_vect)
+{
+  unsigned int sample = ADC; // 0 to 1023 for 0 to 1.1 volts
+  byte ch = adc_ch;
+  if (adc_discard) { // first read after selecting the ADC channel is suspect so it's thrown away
+    adc_discard = false;
+  }
+  else if (adc_seeded & (1 << ch)) {
+    adc_avg[ch] += sample - (adc_avg[ch] >> adc_shift); // average += (sample - average) / 2^adc_shift
+  }
+  else {
+    adc_avg[ch] = sample << adc_shift; // start the average at the first good read
+    adc_seeded |= (1 << ch);
+  }
+  adc_done = true;
+}
+
+// Interrupt runs every tick_ms and wakes the CPU from Power-down
+ISR(WDT_vect)
+{
+  ticks++;
+}
+
+// Interrupt runs when the Pi turnoff input changes and wakes the CPU from Power-down
+ISR(PCINT0_vect)
+{
+  if (PINB & (1 << pi_turnoff)) { // Pi wants the charger off, don't wait for the loop
+    PORTB |= (1 << max_en);
+    TCCR1 = 0; // stop any precharge pulses, the pin goes back to PORTB
+    output = out_off;
+  }
+}
+
+// Function sleeps until an interrupt wakes the CPU up
+void sleep_now(byte mode) 
+{
+  set_sleep_mode(mode);
+  sleep_enable();
+  sleep_cpu();
+  sleep_disable();
+}
+
+// Function converts each ADC channel in ADC Noise Reduction sleep and updates the averages, about 1 msec.
+// ADC Noise Reduction sleep would stop Timer1 too, so while it's pulsing the conversions are started by hand in Idle.
+void adc_sample() 
+{
+  bool idle = (output == out_pulse);
+  ADCSRA = (1 << ADEN) | (1 << ADIE) | (1 << ADPS1) | (1 << ADPS0); // ADC clock is 1MHz / 8 = 125KHz
+  for (byte ch = 0; ch < adc_channels; ch++) {
+    ADMUX = (1 << REFS1) | (ch + 1); // 1.1 volt reference
+    adc_ch = ch;
+    adc_discard = true;
+    for (byte i = 0; i < adc_per_channel; i++) {
+      adc_done = false;
+      if (idle) ADCSRA |= (1 << ADSC);
+      while (!adc_done) { // a conversion starts when the CPU goes to sleep, other interrupts wake it up early
+        sleep_now(idle ? SLEEP_MODE_IDLE : SLEEP_MODE_ADC);
+      }
+    }
+  }
+  ADCSRA = 0; // ADC (and the 1.1 volt reference) off until the next tick
+}
+
+// Function returns the watchdog time in msec
+unsigned long ticks_ms() 
+{
+  noInterrupts(); // the interrupt could change ticks half way through reading it
+  unsigned long t = ticks;
+  interrupts();
+  return t * tick_ms;
+}
+
+// Function sleeps until the next tick or a change on the Pi turnoff input, then samples the ADC.
+// Power-down unless Timer1 is pulsing.
+void sleep_tick() 
+{
+  sleep_now((output == out_pulse) ? SLEEP_MODE_IDLE : SLEEP_MODE_PWR_DOWN);
+  adc_sample();
+}
+
+// Function sleeps for at least the given msec, sampling the ADC every tick
+void nap(unsigned long ms) 
+{
+  unsigned long start = ticks_ms();
+  while ((ticks_ms() - start) < ms) {
+    sleep_tick();
+  }
+}
+
+// Function sets the charger enable pin. Off and on are the port bit, pulse hands the pin to Timer1.
+void drive(byte out)
+{
+  if (out == output) return;
+  noInterrupts(); // so the Pi turnoff interrupt can't land half way through
+  if (out == out_pulse) {
+    power_timer1_enable();
+    TCNT1 = 0;
+    OCR1C = pulse_period; // 1MHz / 16384 = 61 counts a second, 2 second cycle
+    OCR1A = (pulse_on * 61L) / 1000; // charger on from 0 to here, pulse_on msec
+    // PWM on OC1A (max_en), cleared at 0 (charger on) and set on OCR1A (charger off), clock / 16384
+    TCCR1 = (1 << PWM1A) | (1 << COM1A1) | (1 << COM1A0) | (1 << CS13) | (1 << CS12) | (1 << CS11) | (1 << CS10);
+  }
+  else {
+    digitalWrite(max_en, (out == out_on) ? LOW : HIGH); // 0=On, 1=Off
+    TCCR1 = 0; // Timer1 lets go of the pin
+    power_timer1_disable();
+  }
+  output = out;
+  interrupts();
+}
+
+// Function moves to a new charge state
+void set_state(byte new_state, unsigned long now)
+{
+  state = new_state;
+  state_start = now;
+  next_check = now + 1000; // wait 1 second after the charger comes on before measuring current
+}
+
+// Function returns the moving average of a channel, ranging from 0 to 1023 for 0 to 1.1 volts.
+int adc_read(byte ch) 
+{ 
+  noInterrupts(); // the interrupt could change the average half way through reading it
+  unsigned int avg = adc_avg[ch];
+  interrupts();
+  return (avg + (1 << (adc_shift - 1))) >> adc_shift; // rounded
+}
+
+// Thermistor table. Entry i is the temperature in tenths of a degree C for an ADC reading of i * 16, 
+// worked out by the compiler from the values at the top, so there's no floating point in the ATTiny.
+// The ADC reads 1023 below about 8C, where the thermistor voltage goes over the 1.1 volt reference.
+constexpr double ntc_ln_series(double y2, double term, int n) // sum of term / n + term * y2 / (n + 2) + ...
+{
+  return (n > 41) ? 0 : (term / n) + ntc_ln_series(y2, term * y2, n + 2);
+}
+
+constexpr double ntc_ln(double x) // natural log, halving or doubling x until the series is quick
+{
+  return (x > 2) ? ntc_ln(x / 2) + 0.693147181 : (x < 0.5) ? ntc_ln(x * 2) - 0.693147181 :
+    2 * ntc_ln_series(((x - 1) / (x + 1)) * ((x - 1) / (x + 1)), (x - 1) / (x + 1), 1);
+}
+
+constexpr double ntc_ohms(int count) // thermistor resistance for an ADC reading
+{
+  return ntc_pullup * count / ((1024 * ntc_supply / adc_ref) - count);
+}
+
+constexpr int ntc_tenths(double ohms) // B equation, 1/T = 1/T25 + ln(R/R25)/B
+{
+  return (int)((10 / ((1 / 298.15) + (ntc_ln(ohms / ntc_r25) / ntc_beta))) - 2731.5 + 0.5);
+}
+
+constexpr int ntc_entry(int i) // table entry, shorted thermistor (or over 150C) reads as 150C
+{
+  return ((i == 0) || (ntc_tenths(ntc_ohms(i * 16)) > 1500)) ? 1500 : ntc_tenths(ntc_ohms(i * 16));
+}
+
+#define ntc_8(i) ntc_entry(i), ntc_entry(i + 1), ntc_entry(i + 2), ntc_entry(i + 3), \
+  ntc_entry(i + 4), ntc_entry(i + 5), ntc_entry(i + 6), ntc_entry(i + 7)
+const int ntc_table[65] PROGMEM = { ntc_8(0), ntc_8(8), ntc_8(16), ntc_8(24), ntc_8(32), ntc_8(40), ntc_8(48), ntc_8(56), ntc_entry(64) };
+
+// Function returns the battery temperature in tenths of a degree C, interpolated between table entries
+int read_temperature() 
+{
+  int count = adc_read(temp_ch);
+  int t0 = pgm_read_word(&ntc_table[count >> 4]);
+  int t1 = pgm_read_word(&ntc_table[(count >> 4) + 1]);
+  return t0 + ((t1 - t0) * (count & 15)) / 16;
+}
+
+// Function returns true if the battery is too hot to charge. Margin is how far under the max and rise limits it has
+// to be, the rate of rise is always against temp_rate.
+bool too_hot(int margin) 
+{
+  return (temperature > (temp_max - margin)) || ((temperature - temperature_start) > (temp_rise - margin)) ||
+    ((temperature - rate_temp) > temp_rate);
+}
+
+void setup()
+{
+  pinMode(Vbat, INPUT); // divided down battery voltage is input to the ADC on this pin
+  pinMode(bat_temp, INPUT); // voltage divider with NTC thermister is input to the ADC on this pin
+  pinMode(iout, INPUT); // divided down voltage from the Max1873 Iout signal is input to the ADC on this pin
+  pinMode(pi_turnoff, INPUT); // Pi drives this logic input to 3.3V to turn off the Max1873. Pull down resistor on PCB
+  pinMode(max_en, OUTPUT); // charge control output signal drives gate of BS170 NFET. NFET turned on will disable Max1873
+  digitalWrite(max_en, HIGH); // keep charger off initially
+  DIDR0 = (1 << ADC1D) | (1 << ADC2D) | (1 << ADC3D); // no digital input buffers on the analog pins
+  power_timer0_disable(); // millis() and delay() aren't used, time comes from the watchdog timer
+  power_timer1_disable();
+  power_usi_disable();
+  MCUSR &= ~(1 << WDRF);
+  WDTCR = (1 << WDCE) | (1 << WDE); // timed sequence to change the watchdog
+  WDTCR = (1 << WDIE); // interrupt (no reset) every 16 msec
+  PCMSK = (1 << pi_turnoff); // pin change interrupt on the Pi turnoff input
+  GIMSK |= (1 << PCIE);
+  nap(2000); // wait to let the battery temperature and voltage stabilize (and the averages fill)
+// Save initial battery temperature
+  temperature_start = read_temperature(); // Save the starting battery temperature
+  rate_temp = temperature_start;
+  rate_start = ticks_ms();
+// Check battery voltage 
+  battery_voltage = adc_read(vbat_ch); // Read the battery voltage
+  last_pass = ticks_ms(); // charging time is counted from here
+  set_state((battery_voltage < precharge) ? st_precharge : st_charge, last_pass); // Pulse charge if battery voltage is too low
+}
+   
+void loop() // Runs every tick. Temperature and the Pi are checked every pass, the charge current every 5 seconds
+{
+  sleep_tick(); // sleep until the next tick (or the Pi turnoff input changes) and sample the ADC
+  unsigned long now = ticks_ms();
+  temperature = read_temperature(); // Measure the battery temperature (no waiting, it's averaged in the background)
+  if ((now - rate_start) >= rate_time) { // start a new minute for the rate of rise
+    rate_temp = temperature;
+    rate_start = now;
+  }
+  battery_voltage = adc_read(vbat_ch);
+  if (digitalRead(pi_turnoff)) {  // check if Pi wants the charger shut down, in any state
+    drive(out_off); // disable the Max 1873 charger
+  }
+  else {
+    switch (state) {
+      case st_precharge:
+        if (too_hot(0)) { // pulse charging should not make the battery hot, stop charging for good
+          set_state(st_fault, now);
+          drive(out_off); // stop the Timer1 pulses now, not on the next tick
+        }
+        else if ((now - state_start) < pulse_time) {
+          drive(out_pulse); // Timer1 pulses the charger for a minute
+        }
+        else if ((now - state_start) < (pulse_time + rest_time)) {
+          drive(out_off); // Wait before reading the battery voltage
+        }
+        else if (battery_voltage >= precharge) {
+          set_state(st_charge, now); // ready for a normal charge
+        }
+        else {
+          if (battery_voltage < 100) { // check if battery voltage is under 2 volts
+            pulse_on = 100; // don't go below 100ms pulse time
+          }
+          else {
+            pulse_on = battery_voltage; // ADC value makes good msec translation
+          }
+          set_state(st_precharge, now); // another minute with the new pulse time
+        }
+        break;
+      case st_charge:
+      case st_taper:
+        if (too_hot(0)) {
+          set_state(st_cool, now);
+          drive(out_off); // charger off on this pass
+          break;
+        }
+        drive(out_on); // Pi wants the charger enabled 
+        if ((long)(now - next_check) >= 0) {
+          next_check = now + check_time;
+// Check charge current
+          charge_level = adc_read(iout_ch); // Save the charge level
+          if (state == st_charge) {
+            if ((battery_voltage >= cv_level) || (charge_level < taper)) { // current falling off or battery nearly full
+              state = st_taper;
+              old_charge_level = charge_level; // counts as the first check below
+            }
+            break;
+          }
+// Charge current greater than the trickle charge trip level keeps the Max1873 enabled.  
+// No charge current also keeps the Max1873 enabled while waiting for Pi to send turn on sequence over SM Bus. 
+          if ((charge_level < trickle) && (charge_level > no_charge)) { // is current in the shutdown window? 
+            if ((old_charge_level < trickle) && (old_charge_level > no_charge)) { // check levels from the last check
+              set_state(st_done, now); // The charge current has reached the turn off level
+            }
+          } 
+          else if ((charge_level >= taper) && (battery_voltage < cv_level)) { // taking full current again
+            state = st_charge;
+          }
+          old_charge_level = charge_level; // save ADC value for next check
+        }
+        break;
+      case st_cool:
+        drive(out_off); // keep the charger off until the battery cools down
+        if (too_hot(temp_hysteresis)) { // not back under the limits yet
+          state_start = now;
+        }
+        else if ((now - state_start) >= cool_time) {
+          set_state(st_charge, now);
+        }
+        break;
+      default: // st_done, st_fault
+        drive(out_off);
+        break;
+    }
+// Keep track of total charging time
+    if (state < st_done) {
+      charge_ms += now - last_pass; // time since the last pass counts while the Pi has charging enabled
+      if (charge_ms >= 60000) { // a minute
+        charge_ms -= 60000;
+        minute_count++; // increment the minute counter
+      }
+      if (minute_count >= max_minutes) { // has charging reached the time limit?
+        set_state(st_fault, now); // turn charger off to be safe
+        drive(out_off);
+      }
+    }
+  }  
+  last_pass = now;
+}
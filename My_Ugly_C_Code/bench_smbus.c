@@ -0,0 +1,172 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// SMBus benchmark. Runs the same bus code as read_battery (smbus.c and
+// sbs.c) over and over for each bus_quarter setting in a sweep and
+// prints one line of numbers per setting, so a change to the bus code
+// can be compared before and after.
+//
+// For each setting it does -n rounds of:
+// - a full poll, every register with retries like read_battery does,
+//   timed for total bus occupancy, and
+// - one single read_word() of each word register, without sbs.c's
+//   retries, so exactly one transaction each, timed for bus time
+//   (micros()), wall time and CPU time.
+//
+// The columns are:
+//     quarter_us    bus_quarter for this line
+//     transactions  single reads done, failed and fail_rate
+//     late_rate     bit-bang transactions with an edge over a quarter late (smbus.c)
+//     tx_us_*       single read bus time, 50/90/99th percentile and max
+//     wall_us, cpu_us  mean wall and CPU time of a single read
+//     poll_us_*     full poll bus time, 50/99th percentile
+//     retry_rate    full poll reads that were retries (sbs.c)
+//     poll_failed   full poll registers that failed every try
+// Bus time comes from micros(), so on the simulator it is sim time and
+// wall time is how long the PC took.
+//
+// Usage (CSV, or JSON lines with -j):
+//     sudo ./bench_smbus [-d /dev/i2c-N | -d /dev/gpiomem | -g] [-c cpu] [-n rounds] [-q 5,10,15,20,25] [-j]
+// Build it on the Pi with:
+//     gcc -o bench_smbus bench_smbus.c sbs.c smbus.c -l wiringPi -l pthread
+// or against the battery simulator on a PC (see sim/fake_gpio.c):
+//     gcc -funsigned-char -I sim -o bench_smbus bench_smbus.c sbs.c smbus.c sim/fake_gpio.c sim/sbs_slave.c sim/battery_model.c -l pthread -l m
+//
+// Rev 1.0 - Feb 2021 - Original release
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wiringPi.h>
+#include "smbus.h"
+#include "sbs.h"
+
+#define max_settings 16
+
+// Word registers to read singly, from the table in sbs.h
+#define SBS_REG_NUMBER(NAME, field, reg, ...) reg,
+static const unsigned char regs[] = { SBS_WORD_REGISTERS(SBS_REG_NUMBER) };
+#undef SBS_REG_NUMBER
+#define reg_count (int)(sizeof(regs) / sizeof(regs[0]))
+
+// Functions
+static double usec(clockid_t id) // clock in usec
+{
+	struct timespec t;
+	clock_gettime(id, &t);
+	return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+//
+static int by_value(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+	return (x > y) - (x < y);
+}
+//
+static unsigned int percentile(unsigned int *sorted, int n, int p)
+{
+	if (n == 0) return 0;
+	return sorted[(n - 1) * p / 100];
+}
+//
+// Main program
+int main(int argc, char *argv[])
+{
+	const char *device = SMBUS_DEVICE; // NULL = bit-bang, see smbus.h
+	int rounds = 50;
+	const char *sweep = "5,10,15,20,25"; // bus_quarter values, usec
+	_Bool json = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "d:gc:n:q:j")) != -1)
+	{
+		if (opt == 'd') device = optarg; // kernel driver, ie -d /dev/i2c-1
+		else if (opt == 'g') device = NULL; // bit-bang GPIO 2/3
+		else if (opt == 'c') bus_cpu = atoi(optarg); // pin the bit-bang bus worker to this CPU
+		else if (opt == 'n') rounds = atoi(optarg); // rounds for each setting
+		else if (opt == 'q') sweep = optarg; // comma separated bus_quarter values
+		else if (opt == 'j') json = 1; // JSON lines instead of CSV
+		else rounds = 0; // bad option, show the usage
+	}
+	unsigned int quarters[max_settings];
+	int settings = 0;
+	for (const char *p = sweep; *p && (settings < max_settings); ) {
+	  char *end;
+	  quarters[settings] = strtoul(p, &end, 10);
+	  if ((end == p) || (quarters[settings] == 0)) {
+		settings = 0; // not a list of numbers
+		break;
+	  }
+	  settings++;
+	  if (*end != ',') break;
+	  p = end + 1;
+	}
+	if ((rounds <= 0) || (settings == 0) || (optind != argc))
+	{
+		fprintf(stderr, "Usage: %s [-d /dev/i2c-N | -d /dev/gpiomem | -g] [-c cpu] [-n rounds] [-q 5,10,15,20,25] [-j]\n", argv[0]);
+		return 1;
+	}
+	if (setupbus(device)) return 1;
+	pec_probe(); // same as read_battery, PEC if the battery has it
+	unsigned int *tx_us = malloc(rounds * reg_count * sizeof(unsigned int));
+	unsigned int *poll_us = malloc(rounds * sizeof(unsigned int));
+	if (!tx_us || !poll_us) return 1;
+	if (!json) printf("quarter_us,transactions,failed,fail_rate,late_rate,tx_us_p50,tx_us_p90,tx_us_p99,tx_us_max,"
+		"wall_us,cpu_us,poll_us_p50,poll_us_p99,retry_rate,poll_failed\n");
+	for (int s=0; s<settings; s++) {
+	  bus_quarter = quarters[s];
+	  struct smbus_counters before, after;
+	  memset(sbs_stats, 0, sizeof(sbs_stats)); // sbs.c's counters, just for this setting
+	  bus_counters(&before);
+	  int n = 0, failed = 0;
+	  double wall = 0, cpu = 0;
+	  for (int r=0; r<rounds; r++) {
+		struct sbs_snapshot snap;
+		unsigned int start = micros();
+		sbs_poll(SBS_ALL_WORDS | SBS_ALL_BLOCKS, &snap); // the whole read_battery poll
+		poll_us[r] = micros() - start;
+		for (int i=0; i<reg_count; i++) { // then each register once, no retries
+		  double w = usec(CLOCK_MONOTONIC), c = usec(CLOCK_PROCESS_CPUTIME_ID); // the bus worker is in this process
+		  start = micros();
+		  read_word(regs[i]);
+		  tx_us[n++] = micros() - start;
+		  wall += usec(CLOCK_MONOTONIC) - w;
+		  cpu += usec(CLOCK_PROCESS_CPUTIME_ID) - c;
+		  if (error) failed++;
+		}
+	  }
+	  bus_counters(&after);
+	  unsigned int reads = 0, retries = 0, poll_failed = 0;
+	  for (int i=0; i<SBS_REGISTER_COUNT; i++) {
+		reads += sbs_stats[i].reads;
+		retries += sbs_stats[i].retries;
+		poll_failed += sbs_stats[i].failed;
+	  }
+	  unsigned int txs = after.transactions - before.transactions;
+	  unsigned int late = after.late - before.late;
+	  qsort(tx_us, n, sizeof(unsigned int), by_value);
+	  qsort(poll_us, rounds, sizeof(unsigned int), by_value);
+	  const char *format = json ?
+		"{\"quarter_us\":%u,\"transactions\":%d,\"failed\":%d,\"fail_rate\":%.6f,\"late_rate\":%.6f,"
+		"\"tx_us_p50\":%u,\"tx_us_p90\":%u,\"tx_us_p99\":%u,\"tx_us_max\":%u,\"wall_us\":%.1f,\"cpu_us\":%.1f,"
+		"\"poll_us_p50\":%u,\"poll_us_p99\":%u,\"retry_rate\":%.6f,\"poll_failed\":%u}\n" :
+		"%u,%d,%d,%.6f,%.6f,%u,%u,%u,%u,%.1f,%.1f,%u,%u,%.6f,%u\n";
+	  printf(format, bus_quarter, n, failed, (double)failed / n, txs ? (double)late / txs : 0.0,
+		percentile(tx_us, n, 50), percentile(tx_us, n, 90), percentile(tx_us, n, 99), tx_us[n - 1],
+		wall / n, cpu / n, percentile(poll_us, rounds, 50), percentile(poll_us, rounds, 99),
+		reads ? (double)retries / reads : 0.0, poll_failed);
+	  fflush(stdout);
+	}
+	return 0;
+}
@@ -0,0 +1,120 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Coulomb counter. The gauge's State of Charge on an old Dell pack moves
+// in big steps and now and then reads something silly. This counts the
+// charge on the Pi instead, by adding up Current (0x0a) readings over
+// time (trapezoids between readings, in mAh).
+//
+// monitor_battery -r 4 reads just the Current register 4 times a second
+// for this, between the full checks. Without -r only the full checks'
+// readings are counted, which is coarse but still shows drift. When a
+// sampling read fails, the gauge's AverageCurrent (0x0b) from the last
+// full check is used for that stretch, if the pack has it.
+//
+// The count starts from the gauge's RemainingCapacity (0x0f) and is set
+// back to it every anchor_time. Until then the difference between the
+// two is the divergence, and at each anchor it is turned into a drift
+// rate in mAh per hour. A pack whose gauge is going bad shows up as a
+// steady drift long before its SoC does anything odd. monitor_battery -m
+// exports all of it, see metrics.c.
+//
+// Rev 1.0 - Feb 2021 - Original release
+//
+#include <time.h>
+#include "sbs.h"
+#include "coulomb.h"
+
+#define anchor_time 600 // seconds between setting the count back to the gauge's
+#define max_gap 60 // seconds, a longer gap between readings isn't counted (ie suspend)
+
+struct coulomb coulomb = {.soc = -1};
+static _Bool have_current = 0; // last_current is good
+static double last_current; // mA at the last reading
+static struct timespec last_at; // monotonic time of the last reading
+static _Bool have_average = 0;
+static double average; // mA, AverageCurrent from the last full check
+static struct timespec anchor_at; // when the count was last set to the gauge's
+static unsigned int pack; // sbs_pack the count belongs to
+
+// Functions
+static double since(const struct timespec *then, const struct timespec *now) // seconds
+{
+	return (now->tv_sec - then->tv_sec) + (now->tv_nsec - then->tv_nsec) / 1e9;
+}
+//
+static void add(double ma) // a current reading, taken just now
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (have_current) {
+	  double dt = since(&last_at, &now);
+	  if (dt < max_gap) coulomb.charge += (last_current + ma) / 2 * dt / 3600; // mA * s to mAh
+	}
+	last_current = ma;
+	last_at = now;
+	have_current = 1;
+	coulomb.samples++;
+}
+//
+void coulomb_reset(void)
+{
+	coulomb.anchored = 0;
+	coulomb.charge = 0;
+	coulomb.soc = -1;
+	coulomb.divergence = 0;
+	coulomb.drift = 0;
+	have_current = 0;
+	have_average = 0;
+}
+//
+void coulomb_sample(void)
+{
+	struct sbs_snapshot snap;
+	if (sbs_poll(SBS_CURRENT, &snap)) {
+	  add(snap.current);
+	}
+	else {
+	  coulomb.missed++;
+	  if (have_average) add(average); // better than leaving a hole
+	}
+}
+//
+void coulomb_check(const struct sbs_snapshot *snap)
+{
+	if (pack != sbs_pack) coulomb_reset(); // new battery
+	pack = sbs_pack;
+	have_average = (snap->valid & SBS_AVERAGE_CURRENT) != 0;
+	average = snap->average_current;
+	if (snap->valid & SBS_CURRENT) add(snap->current);
+	else if (have_average) add(average);
+	if (snap->valid & SBS_REMAINING_CAP) {
+	  struct timespec now;
+	  clock_gettime(CLOCK_MONOTONIC, &now);
+	  if (!coulomb.anchored) { // start counting from the gauge
+		coulomb.charge = snap->remaining_cap;
+		coulomb.anchored = 1;
+		anchor_at = now;
+	  }
+	  coulomb.divergence = coulomb.charge - snap->remaining_cap;
+	  double t = since(&anchor_at, &now);
+	  if (t >= anchor_time) {
+		coulomb.drift = coulomb.divergence * 3600 / t;
+		coulomb.charge = snap->remaining_cap; // start over from the gauge
+		anchor_at = now;
+	  }
+	}
+	if (coulomb.anchored && (snap->valid & SBS_FULL_CAPACITY)) {
+	  coulomb.soc = coulomb.charge * 100 / snap->full_capacity;
+	}
+}
@@ -0,0 +1,36 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Host side coulomb counter, checked against the gauge. See coulomb.c.
+//
+#ifndef COULOMB_H
+#define COULOMB_H
+
+#include "sbs.h"
+
+struct coulomb {
+	_Bool anchored; // 0 until the gauge's RemainingCapacity has been read once
+	double charge; // mAh in the pack by the host's count
+	double soc; // charge as percent of FullChargeCapacity, -1 = not known
+	double divergence; // mAh, host count minus the gauge's RemainingCapacity at the last check
+	double drift; // mAh per hour the gauge moved away from the host count over the last anchor period
+	unsigned int samples; // current readings added up
+	unsigned int missed; // sampling reads that failed, AverageCurrent was used instead
+};
+extern struct coulomb coulomb;
+
+void coulomb_reset(void); // start over, ie a new pack
+void coulomb_sample(void); // read Current now and add the charge since the last reading
+void coulomb_check(const struct sbs_snapshot *snap); // each full check: count its current and re-anchor to the gauge
+
+#endif
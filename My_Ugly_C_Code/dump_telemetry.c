@@ -0,0 +1,63 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Prints a battery telemetry log (see telemetry.c) as CSV, oldest
+// sample first. -f and -t limit it to a range of unix times, ie the
+// last day:
+//     ./dump_telemetry -f $(date -d yesterday +%s) battery.log > day.csv
+//
+// It doesn't touch the bus so it doesn't need sudo, and it builds on
+// any Linux box without wiringPi or the bus code:
+//     gcc -o dump_telemetry dump_telemetry.c telemetry.c
+//
+// Rev 1.0 - Feb 2021 - Original release
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "telemetry.h"
+
+static time_t from = 0, to = 0; // range to print, 0 = no limit
+
+// Functions
+static int print_sample(const struct telemetry_sample *s, void *arg)
+{
+	(void)arg;
+	if (s->when < from) return 0;
+	if (to && (s->when > to)) return 0; // keep going, a clock change can put later samples back in range
+	char when[32];
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&s->when));
+	printf("%s,%ld,%u,%d,%.2f,%u,%#06x,%u\n", when, (long)s->when, s->voltage, s->current,
+		s->temperature / 10.0 - 273.15, s->soc, s->status, s->retries);
+	return 0;
+}
+//
+// Main program
+int main(int argc, char *argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "f:t:")) != -1)
+	{
+		if (opt == 'f') from = atol(optarg); // first unix time to print
+		else if (opt == 't') to = atol(optarg); // last unix time to print
+		else optind = argc; // bad option, show the usage
+	}
+	if (optind != argc - 1)
+	{
+		fprintf(stderr, "Usage: %s [-f from] [-t to] logfile\n", argv[0]);
+		return 1;
+	}
+	printf("time,unix,voltage_mV,current_mA,temperature_C,soc,status,retries\n");
+	if (telemetry_read(argv[optind], print_sample, NULL) < 0) return 1;
+	return 0;
+}
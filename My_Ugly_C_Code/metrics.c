@@ -0,0 +1,241 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Metrics endpoint. monitor_battery -m 9101 answers Prometheus scrapes
+// on http://127.0.0.1:9101/metrics (any path works), and -m with a file
+// name answers on a Unix socket instead:
+//     curl --unix-socket /run/battery_metrics.sock http://pi/metrics
+//
+// The page has every decoded word register from the table in sbs.h, the
+// BatteryStatus bits, the pack's names, the per register read, retry and
+// bad read counters from sbs.c, the bus counters and the request and
+// edge timing histograms from smbus.c, how late the poll timer went off
+// and the host side coulomb count from coulomb.c. It is rendered once
+// by metrics_update() right after each check, so a scrape is just a
+// copy of that text. It never goes on the bus, no matter how often the
+// bench scrapes.
+//
+// Scrapes are answered from monitor_battery's epoll loop, one at a time.
+// The client gets 200 msec to send its request and take the page, so a
+// stuck client can't hold up a battery check for long.
+//
+// Rev 1.0 - Feb 2021 - Original release
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "smbus.h"
+#include "sbs.h"
+#include "metrics.h"
+#include "coulomb.h"
+
+#define page_size 32768 // rendered text, under half of it is used
+#define client_ms 200 // time a scraper gets to send and receive
+
+static char page[page_size]; // latest rendered metrics
+static int page_len = 0;
+static double lag_max = 0; // worst poll timer lag so far
+
+// Register names for labels, ie "voltage"
+#define SBS_NAME(NAME, field, ...) #field,
+static const char *names[SBS_REGISTER_COUNT] = { SBS_WORD_REGISTERS(SBS_NAME) SBS_BLOCK_REGISTERS(SBS_NAME) };
+#undef SBS_NAME
+
+// Functions
+static void put(const char *format, ...) // add text to the page, drops what doesn't fit
+{
+	va_list args;
+	va_start(args, format);
+	int n = vsnprintf(page + page_len, page_size - page_len, format, args);
+	va_end(args);
+	if ((n > 0) && (page_len + n < page_size)) page_len += n;
+}
+//
+static void head(const char *name, const char *type, const char *help)
+{
+	put("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+//
+static void put_label(const char *text) // quoted label value, escaped
+{
+	put("\"");
+	for (; *text; text++) {
+	  if ((*text == '"') || (*text == '\\')) put("\\%c", *text);
+	  else if (isprint((unsigned char)*text)) put("%c", *text);
+	  else put("?"); // battery strings aren't always clean
+	}
+	put("\"");
+}
+//
+static void put_hist(const char *name, const char *help, const unsigned int *hist, unsigned long long sum_us)
+{
+	unsigned int count = 0;
+	head(name, "histogram", help);
+	for (int i=0; i<SMBUS_BUCKETS - 1; i++) { // bucket i tops out at 2^i - 1 usec
+	  count += hist[i];
+	  put("%s_bucket{le=\"%g\"} %u\n", name, ((1u << i) - 1) / 1e6, count);
+	}
+	count += hist[SMBUS_BUCKETS - 1];
+	put("%s_bucket{le=\"+Inf\"} %u\n%s_sum %g\n%s_count %u\n", name, count, name, sum_us / 1e6, name, count);
+}
+//
+void metrics_update(const struct sbs_snapshot *snap, double lag, int period)
+{
+	struct smbus_counters bus;
+	bus_counters(&bus);
+	if (lag > lag_max) lag_max = lag;
+	page_len = 0;
+	// Registers, in display units. Ones that weren't read are left out.
+#define SBS_METRIC(NAME, field, reg, type, scale, offset, min, max, flags, age, tries, label, format, unit) \
+	head("sbs_" #field, "gauge", label " " unit); \
+	if (snap->valid & SBS_##NAME) put("sbs_" #field " %.10g\n", sbs_##field(snap));
+	SBS_WORD_REGISTERS(SBS_METRIC)
+#undef SBS_METRIC
+	head("sbs_valid", "gauge", "1 if the register was read OK in the last check");
+	for (int i=0; i<SBS_REGISTER_COUNT; i++) {
+	  put("sbs_valid{register=\"%s\"} %d\n", names[i], (snap->valid >> i) & 1);
+	}
+	if (snap->valid & SBS_STATUS) {
+	  head("sbs_status_bit", "gauge", "BatteryStatus bits");
+#define SBS_BIT(mask, text) put("sbs_status_bit{bit=\"" #mask "\",name=\"" text "\"} %d\n", (snap->status & mask) != 0);
+	  SBS_STATUS_BITS(SBS_BIT)
+#undef SBS_BIT
+	}
+	head("sbs_info", "gauge", "Names the pack gives itself");
+	put("sbs_info{manufacturer=");
+	put_label((snap->valid & SBS_MANUFACTURER) ? snap->manufacturer : "");
+	put(",device_name=");
+	put_label((snap->valid & SBS_DEVICE_NAME) ? snap->device_name : "");
+	put("} 1\n");
+	head("sbs_packs_seen", "gauge", "Battery packs seen since start");
+	put("sbs_packs_seen %u\n", sbs_pack);
+	head("sbs_sample_timestamp_seconds", "gauge", "Wall clock time of the last check");
+	put("sbs_sample_timestamp_seconds %ld.%03ld\n", (long)snap->when.tv_sec, snap->when.tv_nsec / 1000000);
+	head("sbs_poll_duration_seconds", "gauge", "How long the last check took on the bus");
+	put("sbs_poll_duration_seconds %g\n", snap->bus_us / 1e6);
+	// Register read counters from sbs.c
+	head("sbs_reads_total", "counter", "Register reads, retries included");
+	for (int i=0; i<SBS_REGISTER_COUNT; i++) put("sbs_reads_total{register=\"%s\"} %u\n", names[i], sbs_stats[i].reads);
+	head("sbs_retries_total", "counter", "Register reads after the first one of a check");
+	for (int i=0; i<SBS_REGISTER_COUNT; i++) put("sbs_retries_total{register=\"%s\"} %u\n", names[i], sbs_stats[i].retries);
+	head("sbs_failed_total", "counter", "Checks where every read of the register was bad");
+	for (int i=0; i<SBS_REGISTER_COUNT; i++) put("sbs_failed_total{register=\"%s\"} %u\n", names[i], sbs_stats[i].failed);
+	head("sbs_bad_reads_total", "counter", "Bad register reads by cause (NACKs, timeouts, PEC, range)");
+	for (int i=0; i<SBS_REGISTER_COUNT; i++) {
+	  for (int why=SMBUS_OK + 1; why<SBS_ERRORS; why++) {
+		put("sbs_bad_reads_total{register=\"%s\",why=\"%s\"} %u\n", names[i], sbs_error_name(why), sbs_stats[i].why[why]);
+	  }
+	}
+	// Bus counters from smbus.c
+	head("smbus_requests_total", "counter", "Reads, writes and PEC probes on any transport");
+	put("smbus_requests_total %u\n", bus.requests);
+	put_hist("smbus_request_duration_seconds", "Time from a bus request to its answer", bus.request_hist, bus.request_us);
+	head("smbus_transactions_total", "counter", "Bit-bang transactions");
+	put("smbus_transactions_total %u\n", bus.transactions);
+	head("smbus_failed_transactions_total", "counter", "Bit-bang transactions with a NACK or timeout");
+	put("smbus_failed_transactions_total %u\n", bus.failed);
+	head("smbus_late_transactions_total", "counter", "Bit-bang transactions with an edge over a quarter period late");
+	put("smbus_late_transactions_total %u\n", bus.late);
+	head("smbus_late_failed_transactions_total", "counter", "Late bit-bang transactions that also failed");
+	put("smbus_late_failed_transactions_total %u\n", bus.late_failed);
+	put_hist("smbus_edge_lateness_seconds", "How late each bit-bang edge came", bus.late_hist, bus.late_us);
+	head("smbus_pec", "gauge", "1 if PEC bytes are being checked");
+	put("smbus_pec %d\n", pec);
+	// Host side charge count
+	if (coulomb.anchored) {
+	  head("coulomb_charge_mah", "gauge", "Charge in the pack counted on the host");
+	  put("coulomb_charge_mah %.1f\n", coulomb.charge);
+	  if (coulomb.soc >= 0) {
+		head("coulomb_soc_percent", "gauge", "Host count as percent of FullChargeCapacity");
+		put("coulomb_soc_percent %.2f\n", coulomb.soc);
+	  }
+	  head("coulomb_divergence_mah", "gauge", "Host count minus the gauge's RemainingCapacity");
+	  put("coulomb_divergence_mah %.1f\n", coulomb.divergence);
+	  head("coulomb_drift_mah_per_hour", "gauge", "How fast the gauge moved away from the host count, last anchor period");
+	  put("coulomb_drift_mah_per_hour %.1f\n", coulomb.drift);
+	}
+	head("coulomb_samples_total", "counter", "Current readings counted");
+	put("coulomb_samples_total %u\n", coulomb.samples);
+	head("coulomb_missed_total", "counter", "Sampling reads that failed");
+	put("coulomb_missed_total %u\n", coulomb.missed);
+	// Poll loop
+	head("monitor_poll_lag_seconds", "gauge", "How late the poll timer went off for the last check");
+	put("monitor_poll_lag_seconds %g\n", lag);
+	head("monitor_poll_lag_max_seconds", "gauge", "Worst poll timer lag since start");
+	put("monitor_poll_lag_max_seconds %g\n", lag_max);
+	head("monitor_poll_period_seconds", "gauge", "Time until the next check");
+	put("monitor_poll_period_seconds %d\n", period);
+}
+//
+int metrics_open(const char *where)
+{
+	int fd;
+	char *end;
+	long port = strtol(where, &end, 10);
+	if ((*end == 0) && (port > 0) && (port < 65536)) { // localhost only, nobody else needs it
+	  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+	  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	  int on = 1;
+	  fd = socket(AF_INET, SOCK_STREAM, 0);
+	  if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)); // restart without waiting
+	  if ((fd < 0) || bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror(where);
+		return -1;
+	  }
+	}
+	else {
+	  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	  strncpy(addr.sun_path, where, sizeof(addr.sun_path) - 1);
+	  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	  unlink(where); // left over from the last run
+	  if ((fd < 0) || bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror(where);
+		return -1;
+	  }
+	  chmod(where, 0666); // scrapers don't need root
+	}
+	if (listen(fd, 4)) {
+	  perror(where);
+	  close(fd);
+	  return -1;
+	}
+	return fd;
+}
+//
+void metrics_serve(int fd)
+{
+	int client = accept(fd, NULL, NULL);
+	if (client < 0) return;
+	struct timeval limit = {0, client_ms * 1000};
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+	setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+	char request[512];
+	if (recv(client, request, sizeof(request), 0) > 0) { // the GET line, which path doesn't matter
+	  char header[128];
+	  struct iovec out[2] = {{header, 0}, {page, page_len}};
+	  out[0].iov_len = snprintf(header, sizeof(header),
+		"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n", page_len);
+	  writev(client, out, 2); // if the scraper gave up there's nothing to do
+	}
+	close(client);
+}
@@ -0,0 +1,25 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Prometheus text endpoint for monitor_battery. See metrics.c.
+//
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "sbs.h"
+
+int metrics_open(const char *where); // "9101" = 127.0.0.1:9101, else a Unix socket path. Listening fd, -1 = failed
+void metrics_update(const struct sbs_snapshot *snap, double lag, int period); // render the page after each check
+void metrics_serve(int fd); // answer one scrape, call when the listening fd is ready
+
+#endif
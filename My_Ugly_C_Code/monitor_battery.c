@@ -12,7 +12,7 @@
    limitations under the License.
 */
 // Compile and build this program with Geany on the Pi.
-// Add -l wiringPi to the Compile & Build and sudo to the execute per:
+// Add sbs.c smbus.c telemetry.c sbs_shm.c metrics.c predict.c coulomb.c -l wiringPi -l pthread -l rt -l m to the Compile & Build and sudo to the execute per:
 // https://learn.sparkfun.com/tutorials/raspberry-gpio/using-an-ide
 // The Raspberry Pi 4B requires wiringPi version 2.52 or later
 //
@@ -36,194 +36,221 @@ WantedBy=multi=user.target
 systemctl daemon-reload
 systemctl enable bat_monitor --now
 */
-// The program will monitor battery state of charge every 30 seconds and 
+// The program will monitor battery state of charge and 
 // issue a sudo shutdown -h now command if the battery is nearly empty.
-// At 15% SoC, the blue LED turns on constantly to indicate a low battery warning. 
-// At 10% SoC, the LCD blinks off and on every 30 seconds to get the users attention. 
-// At 8% SoC, a safe shutdown is executed.
+// How long the battery has left is predicted from the SoC and the
+// discharge current of the recent checks (see predict.c), counting down
+// to 8% SoC, the same floor the fixed steps always shut down at. A busy
+// Pi gets its warnings earlier than the fixed steps would give.
+// At 15 minutes left, the blue LED turns on constantly to indicate a low battery warning. 
+// At 8 minutes left, the LCD blinks off and on every 30 seconds to get the users attention. 
+// At 3 minutes left or 8% SoC (10% on the check before), a safe shutdown is executed.
+// Until there is a prediction (no current reading yet), the old SoC
+// steps are used, 15/10/8%.
+//
+// The battery is checked every 60 seconds while charging, every 30
+// seconds when discharging and faster as the prediction gets near the
+// end (a tenth of the time left, down to every 5 seconds). The program
+// sleeps in epoll_wait() between checks.
+// One timerfd sets the poll times, a second one steps through the LED
+// and LCD blink patterns so the blinks don't hold up the next check.
 // 
-// This program reads the laptop battery status registers over a bit-
-// bang SMBus created with two of the Pi's GPIO pins and wiringPi. 
-// SMBus Data and clock are pulled to 3.3 volts with resistors on the Pi.
-// Data is wired from Pi GPIO 2 to Dell D630 battery pin 4.
+// This program reads the laptop battery status registers over the SMBus.
+// By default the bus is bit-banged on two of the Pi's GPIO pins with
+// wiringPi. Data is wired from Pi GPIO 2 to Dell D630 battery pin 4.
 // Clock is wired from Pi GPIO 3 to Dell D630 battery pin 3.
+// Add -d /dev/i2c-1 to ExecStart to use the kernel I2C driver instead
+// so the monitor doesn't need top priority. See smbus.c for details.
+// Add -d /run/smbus_broker.sock when smbus_broker owns the bus so other
+// programs can use it at the same time (see smbus_broker.c).
+// Add -l /home/pi/battery.log to keep every check in a telemetry log,
+// read it back with dump_telemetry. See telemetry.c.
+// Each snapshot is also shared in /dev/shm/sbs_battery so other programs
+// can get the battery state without going on the bus. See sbs_shm.c.
+// Add -m 9101 to serve Prometheus metrics on 127.0.0.1:9101, or
+// -m /run/battery_metrics.sock for a Unix socket. See metrics.c.
+// Add -r 4 to read the current 4 times a second between checks and count
+// the charge on the Pi as well as the gauge does. See coulomb.c.
+// Add -t /run/smbus_trace to keep a trace of the bit-bang bus edges and
+// write a VCD file for GTKWave whenever a read fails. See smbus.c.
 //
 // Revision History - The previous version of this code was for a
 // Pi-Teensy laptop made from a Sony Vaio. It is documented at
 // github.com/thedalles77/Pi_Teensy_Laptop. 
 //
 // Rev 1.0 - Nov 20, 2020 - The code was cleaned up from the Sony-Pi version
+// Rev 1.1 - Feb 2021 - timerfd/epoll loop with an adaptive poll period
+// Rev 1.2 - Feb 2021 - Telemetry log
+// Rev 1.3 - Feb 2021 - Publish snapshots in shared memory
+// Rev 1.4 - Feb 2021 - Prometheus metrics endpoint
+// Rev 1.5 - Feb 2021 - Warnings and shutdown on predicted time left
+// Rev 1.6 - Feb 2021 - Host side coulomb counter
+// Rev 1.7 - Feb 2021 - Bus edge trace option
+// Rev 1.8 - Mar 2021 - Dell enable sent to each new pack, not on every check
 //
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <wiringPi.h>
+#include "smbus.h"
+#include "sbs.h"
+#include "telemetry.h"
+#include "sbs_shm.h"
+#include "metrics.h"
+#include "predict.h"
+#include "coulomb.h"
 
-// Pin number declarations
-#define clock 3 // SMBus clock on Pin 5, GPIO3
-#define data 2 // SMBus data on Pin 3, GPIO2
+// Pin number declarations (SMBus pins are in smbus.c)
 #define lcd_pwr 4 // Toggle LCD power on/off Pin 7, GPIO 4 (active low)
 #define led_cntrl 17 // Blue LED Control Pin 11, GPIO 17 (active high)
 #define charge_dis 19 // Disable Max1873 battery charger Pin 35,GPIO 19 (active high)
 #define lcd_status 22 // Pin 15, GPIO 22 Shows if LCD is on (3.3 V) or off (0 v)
 
-// time constants
-#define quarter 10 // quarter period time in usec
+// Poll periods in seconds
+#define period_charging 60 // charger plugged in
+#define period_normal 30 // discharging above 25%
+#define period_low 15 // 25% or less
+#define period_warn 10 // 17% or less, getting near the LED warning
+#define period_critical 5 // 12% or less, getting near the LCD blink and shutdown
+
+// Predicted seconds left (see predict.c)
+#define cutoff_soc 8 // percent, the time left counts down to here, and the SoC shutdown floor
+#define warn_left 900 // blue LED on
+#define blink_left 480 // LCD blinks
+#define shutdown_left 180 // enough for a safe shutdown even if the load goes up
+#define over_temp_time 90 // seconds of over temperature before shutting down
+#define lcd_blink_time 30 // seconds between LCD blinks
+#define dell_enable_time 600 // seconds between Dell charge enable writes to the same pack
+#define max_sample_rate 20 // current readings a second for the coulomb counter (-r)
+
+// Blink patterns, one step per pin change then how long to wait in ms
+struct step {
+	char pin;
+	char level; // 0 = drive low, 1 = drive high, 2 = float (pulled up)
+	short ms; // wait before the next step
+};
+static const struct step heartbeat[] = {{led_cntrl, 1, 1000}, {led_cntrl, 0, 0}}; // soc above 15%
+static const struct step warning[] = {{led_cntrl, 0, 1000}, {led_cntrl, 1, 0}}; // soc 15% or less
+static const struct step lcd_blink[] = { // soc 10% or less
+	{lcd_pwr, 0, 250}, {lcd_pwr, 2, 2000}, // LCD off
+	{lcd_pwr, 0, 250}, {lcd_pwr, 2, 0}, // LCD back on
+	{led_cntrl, 1, 0}}; // blue LED on
+static const struct step charged[] = { // fully charged, blink 3 times
+	{led_cntrl, 1, 250}, {led_cntrl, 0, 250},
+	{led_cntrl, 1, 250}, {led_cntrl, 0, 250},
+	{led_cntrl, 1, 250}, {led_cntrl, 0, 0}};
+static const struct step charging[] = { // charging, blink twice
+	{led_cntrl, 1, 333}, {led_cntrl, 0, 333},
+	{led_cntrl, 1, 333}, {led_cntrl, 0, 0}};
+#define steps(pattern) pattern, sizeof(pattern) / sizeof(pattern[0])
 
-// Global variables
-_Bool error = 0; // set to 1 when battery gives a NACK
+static int poll_timer, blink_timer, sample_timer; // timerfds
+static struct timespec next_check; // when the poll timer goes off next (CLOCK_MONOTONIC)
+static const struct step *pattern; // blink pattern being played
+static int pattern_len, pattern_pos;
 
 // Functions
-void go_z(int pin) // float the pin and let pullup or battery set level
-{
-	pinMode(pin, INPUT); // set pin as input to tri-state the driver
-}
-//
-void go_0(int pin) // drive the pin low
-{
-	pinMode(pin, OUTPUT); // set pin as output
-	digitalWrite(pin, LOW); // drive pin low
-}
-//
 void go_1(int pin) // drive the pin high
 {
 	pinMode(pin, OUTPUT); // set pin as output
 	digitalWrite(pin, HIGH); // drive pin high
 }
 //
-int read_pin(int pin) // read the pin and return logic level
+static void arm(int timer, long ms) // one shot timer, ms from now (0 = stop it)
 {
-	pinMode(pin, INPUT); // set pin as input
-	return (digitalRead(pin)); // return the logic level
+	struct itimerspec when = {{0, 0}, {ms / 1000, (ms % 1000) * 1000000}};
+	timerfd_settime(timer, 0, &when, NULL);
 }
 //
-void setupbus(void)
+static void check_in(int seconds) // next battery check, counted from the last one so it doesn't drift
 {
-	wiringPiSetupGpio(); //Init wiringPi using the Broadcom GPIO numbers
-	piHiPri(99); //Make program the highest priority (Linux will still out prioritize)
-	go_z(clock); // set clock and data to inactive state
-	go_z(data);
-	delayMicroseconds(200); // wait before sending data
+	struct itimerspec when = {{0, 0}, {0, 0}};
+	next_check.tv_sec += seconds;
+	when.it_value = next_check;
+	timerfd_settime(poll_timer, TFD_TIMER_ABSTIME, &when, NULL);
 }
 //
-void startbus(void)
+static void next_step(void) // do the next pin change of the pattern
 {
-	delayMicroseconds(1000); // needed when doing multiple reads
-	go_0(data);	// start condition - data low when clock goes low
-	delayMicroseconds(quarter);
-	go_0(clock);
-	delayMicroseconds(4 * quarter); // wait 1 period before proceeding
-}
-//
-void send8(char sendbits)
-{
-	// send bits 7 down to 0, using a mask that starts with 10000000
-	// and gets shifted right 1 bit each loop
-	char mask = 0x80;
-	for (char j=0; j<8; j++)   {  //loop 8 times
-	  if (!(sendbits & mask)) { // check if mask bit is low
-        go_0(data); // send low
-	  }
-	  else
-	  {
-		go_z(data); // send high
-	  }
- 	  delayMicroseconds(quarter);
-	  go_z(clock); // clock high
-	  delayMicroseconds(quarter * 2);
-	  go_0(clock); // clock low
-	  delayMicroseconds(quarter);
-      mask = mask >> 1; // shift mask 1 bit to the right
-    }
-	// ack/nack
-	delayMicroseconds(quarter * 4);
-	go_z(data); // float data to see ack
-	delayMicroseconds(quarter);
-	go_z(clock); // clock high
-	// read data to see if battery sends a low (acknowledge transfer)
-	if (read_pin(data)) {  // is the data bit high?
-	  error = 1; // battery did not acknowledge the transfer
+	while (pattern_pos < pattern_len)
+	{
+		const struct step *s = &pattern[pattern_pos++];
+		if (s->level == 0) go_0(s->pin);
+		else if (s->level == 1) go_1(s->pin);
+		else go_z(s->pin);
+		if (s->ms) {
+		  arm(blink_timer, s->ms); // come back when it's time for the next one
+		  return;
+		}
 	}
-	delayMicroseconds(quarter * 2);
-	go_0(clock); // clock low
-	go_0(data); // data low
-	delayMicroseconds(quarter * 90);
 }
 //
-void sendrptstart(void) // send repeated start condition
-{				
-	go_z(data); // data high
-	delayMicroseconds(quarter * 8);
-	go_z(clock); // clock high
-	delayMicroseconds(quarter * 2);
-	go_0(data); // data low
-	delayMicroseconds(quarter * 2);
-	go_0(clock); // clock low
-	delayMicroseconds(quarter * 16);
+static void blink(const struct step *p, int len) // start a pattern, replaces one still playing
+{
+	pattern = p;
+	pattern_len = len;
+	pattern_pos = 0;
+	next_step();
 }
 //
-int read16(void) // read low byte and high byte, return the 16 bit word
+static int next_period(int soc, int left, _Bool discharging) // seconds to the next check
 {
-	int readval = 0x00; // initialize read word to zero
-	int mask = 0x80; // start with bit 7 of low byte
-	// read low byte
-	for (int k=0; k<8; k++) { 
-	  go_z(data);
-	  delayMicroseconds(quarter);
-	  if (read_pin(data)) {
-		readval = readval | mask;
-	  }
-	  mask = mask >> 1; // shift mask 1 bit right
-	  go_z(clock); // clock high
-	  delayMicroseconds(quarter * 2);
-	  go_0(clock); // clock low
-	  delayMicroseconds(quarter);
-    }
-	// ack/nack of low byte
-	delayMicroseconds(quarter * 2);
-	go_0(data); // send ack back to battery
-	delayMicroseconds(quarter);
-	go_z(clock); // clock high
-	delayMicroseconds(quarter * 2);
-	go_0(clock); // clock low
-	go_0(data); // data low
-	delayMicroseconds(quarter * 40);		
-    // read high byte
-    mask = 0x8000; // start with bit 7 of high byte
-	for (int k=0; k<8; k++) { 
-	  go_z(data);
-	  delayMicroseconds(quarter);
-	  if (read_pin(data)) {
-		readval = readval | mask;
-	  }
-	  mask = mask >> 1; // shift mask 1 bit right
-	  go_z(clock); // clock high
-	  delayMicroseconds(quarter * 2);
-	  go_0(clock); // clock low
-	  delayMicroseconds(quarter);
-    }
-	// ack/nack of high byte
-	delayMicroseconds(quarter * 2);
-	go_z(data); // send nack back to battery
-	delayMicroseconds(quarter);
-	go_z(clock); // clock high
-	delayMicroseconds(quarter * 2);
-	go_0(clock); // clock low
-	go_0(data); // data low
-	delayMicroseconds(quarter * 8);	
-	return readval;
+	if (!discharging) return period_charging;
+	if (left >= 0) { // a tenth of the time left, so the warnings come on time
+	  if (left / 10 < period_critical) return period_critical;
+	  if (left / 10 > period_normal) return period_normal;
+	  return left / 10;
+	}
+	if (soc <= 12) return period_critical; // no prediction yet, go by the SoC
+	if (soc <= 17) return period_warn;
+	if (soc <= 25) return period_low;
+	return period_normal;
 }
 //
-void stopbus(void) // stop condition, data low when clock goes high
+static long now_s(void) // monotonic seconds
 {
-	go_z(clock); // clock high
-	delayMicroseconds(quarter);	
-	go_z(data);	// data high
-	delayMicroseconds(quarter * 30);	
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
 }
+//
 // Main program	
-int main(void)
-{        
-	setupbus(); // initialize wiringPi and setup the GPIO SMBus 
+int main(int argc, char *argv[])
+{
+	const char *device = SMBUS_DEVICE; // NULL = bit-bang, see smbus.h
+	int opt;
+	const char *log_path = NULL; // -l, see telemetry.c
+	const char *metrics_at = NULL; // -m, see metrics.c
+	int sample_rate = 0; // -r, current readings a second, 0 = only at the checks
+	while ((opt = getopt(argc, argv, "d:gc:l:m:r:t:")) != -1)
+	{
+		if (opt == 'd') device = optarg; // kernel driver, ie -d /dev/i2c-1
+		else if (opt == 'g') device = NULL; // bit-bang GPIO 2/3
+		else if (opt == 'c') bus_cpu = atoi(optarg); // pin the bit-bang bus worker to this CPU
+		else if (opt == 'l') log_path = optarg; // keep every sample in a telemetry log
+		else if (opt == 'm') metrics_at = optarg; // serve metrics on this port or socket
+		else if (opt == 'r') sample_rate = atoi(optarg); // coulomb counter readings a second
+		else if (opt == 't') bus_trace = optarg; // dump failed bit-bang transactions as VCD files
+		else
+		{
+			fprintf(stderr, "Usage: %s [-d /dev/i2c-N | -d /dev/gpiomem | -d socket | -g] [-c cpu] [-l logfile] [-m port | -m socket] [-r hz] [-t tracefile]\n", argv[0]);
+			return 1;
+		}
+	}
+	if ((sample_rate < 0) || (sample_rate > max_sample_rate))
+	{
+		fprintf(stderr, "%s: -r goes from 0 to %d\n", argv[0], max_sample_rate);
+		return 1;
+	}
+	setupgpio(); // initialize wiringPi for the LED, LCD and charger pins
+	if (setupbus(device)) return 1; // setup the SMBus
+	if (log_path && telemetry_open(log_path, telemetry_records)) return 1;
+	sbs_publish_open(); // share each snapshot, read_battery --cached reads it from there
+	int metrics_fd = -1; // listening socket for scrapes
+	if (metrics_at && ((metrics_fd = metrics_open(metrics_at)) < 0)) return 1;
 	go_0(led_cntrl); // start with blue led off
 	go_0(charge_dis); // start with battery charger enabled
 	go_z(lcd_pwr); // pull up on video card makes it logic 1 (no pulse)
@@ -235,43 +262,94 @@ int main(void)
 		delay(250); // wait a quarter second 
 		go_z(lcd_pwr); // release power signal so pull up brings it high
 	}
+	// Event loop setup, a timer for the battery checks and one for the blinks
+	int events = epoll_create1(0);
+	poll_timer = timerfd_create(CLOCK_MONOTONIC, 0);
+	blink_timer = timerfd_create(CLOCK_MONOTONIC, 0);
+	sample_timer = timerfd_create(CLOCK_MONOTONIC, 0);
+	if ((events < 0) || (poll_timer < 0) || (blink_timer < 0) || (sample_timer < 0))
+	{
+		perror("monitor_battery: timers");
+		return 1;
+	}
+	struct epoll_event ev = {.events = EPOLLIN};
+	ev.data.fd = poll_timer;
+	epoll_ctl(events, EPOLL_CTL_ADD, poll_timer, &ev);
+	ev.data.fd = blink_timer;
+	epoll_ctl(events, EPOLL_CTL_ADD, blink_timer, &ev);
+	if (metrics_fd >= 0) {
+	  ev.data.fd = metrics_fd;
+	  epoll_ctl(events, EPOLL_CTL_ADD, metrics_fd, &ev);
+	}
+	if (sample_rate) { // repeating, the coulomb counter times each reading itself
+	  long ns = 1000000000L / sample_rate;
+	  struct itimerspec every = {{ns / 1000000000L, ns % 1000000000L}, {ns / 1000000000L, ns % 1000000000L}};
+	  timerfd_settime(sample_timer, 0, &every, NULL);
+	  ev.data.fd = sample_timer;
+	  epoll_ctl(events, EPOLL_CTL_ADD, sample_timer, &ev);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &next_check);
+	check_in(0); // first check right away
+	
 	int soc; // variable to store the state of charge
 	int old_soc = 50; // soc from last time battery was checked (start at mid scale)
+	struct sbs_snapshot bat; // battery registers from the latest poll
 	unsigned short bat_stat; // variable to store the battery status
 	_Bool bad_bat_stat = 0; // 
-	char over_temp_count = 0; // count consecutive overtemp loops 
+	long over_temp_since = 0; // when the overtemperature started, 0 = not over temp
+	long last_lcd_blink = 0; // when the LCD was last blinked
+	unsigned int enabled_pack = 0; // sbs_pack the Dell enable was last sent to, 0 = none yet
+	long last_enable = 0; // when it was sent
 	while(1)  // main (infinite) loop
 	{
+		struct epoll_event ready;
+		unsigned long long expired;
+		if (epoll_wait(events, &ready, 1, -1) < 1) continue; // interrupted
+		if (ready.data.fd == metrics_fd)
+		{
+			metrics_serve(metrics_fd); // a scrape, answered from the last check
+			continue;
+		}
+		read(ready.data.fd, &expired, sizeof(expired)); // clear the timer
+		if (ready.data.fd == blink_timer)
+		{
+			next_step(); // carry on with the LED/LCD pattern
+			continue;
+		}
+		if (ready.data.fd == sample_timer)
+		{
+			coulomb_sample(); // one Current reading, see coulomb.c
+			continue;
+		}
+		int period = period_normal; // seconds until the next check
+		struct timespec woke;
+		clock_gettime(CLOCK_MONOTONIC, &woke);
+		double lag = (woke.tv_sec - next_check.tv_sec) + (woke.tv_nsec - next_check.tv_nsec) / 1e9; // how late the check is
+		// Read all the registers together (bad reads are retried in sbs_poll).
+		// Everything is read since it is shared with other programs, the
+		// cache keeps the ones that only change with the pack. It also checks
+		// the serial number once a minute to catch a pack swap and probes
+		// PEC on each new pack.
+		sbs_cached(SBS_ALL_WORDS | SBS_ALL_BLOCKS, &bat);
 //------------Enable Dell Battery for charging-------------
 		// Most batteries don't need this and will hopefully ignore this sequence. 
 		// Comment out this sequence if it causes problems
-		send8(0x16); // send battery address 0x16 (0x0b w/ write)
-		send8(0x00); // load register pointer 0x00 (Manufacturer special purpose)
-		send8(0x0A); // load value 0x0A into low byte of register zero
-		send8(0x00); // load value 0 into high byte of register zero
-		stopbus(); // send stop condition
-//------------Finished enabling Dell battery for charging----------
-		// Read Battery status 
-		error = 0; // initialize to no error
-		startbus(); // send start condition
-		send8(0x16); // send battery address 0x16 (0x0b w/ write)
-		send8(0x16); // load register pointer 0x16
-		sendrptstart(); // send repeated start condition				
-		send8(0x17); // send battery address 0x17 (0x0b w/ read)
-		bat_stat = read16(); //read 16 bit battery status
-		stopbus(); // send stop condition
-		if ((bat_stat == 0xffff) | (error))// read again if all 1's or nack
+		// It is sent to each new pack and then every dell_enable_time, not
+		// on every check (and on every check while the battery isn't
+		// answering). A write makes smbus_broker forget the reads it
+		// shares, so writing each time would undo its coalescing.
+		if (!(bat.valid & SBS_STATUS) || (sbs_pack != enabled_pack) || ((now_s() - last_enable) >= dell_enable_time))
 		{
-			error = 0; // initialize to no error
-			startbus(); // send start condition
-			send8(0x16); // send battery address 0x16 (0x0b w/ write)
-			send8(0x16); // load register pointer 0x16
-			sendrptstart(); // send repeated start codition				
-			send8(0x17); // send battery address 0x17 (0x0b w/ read)
-			bat_stat = read16();
-			stopbus(); // send stop condition
-		}  
-        if ((bat_stat == 0xffff) | (error)) // Check for no/bad response from battery
+			write_word(0x00, 0x000A); // load 0x000A into register 0x00 (Manufacturer special purpose)
+			enabled_pack = sbs_pack;
+			last_enable = now_s();
+		}
+//------------Finished enabling Dell battery for charging----------
+		telemetry_log(&bat); // keep the sample if there is a log (-l)
+		coulomb_check(&bat); // count this check's current, re-anchor to RemainingCapacity
+		sbs_publish(&bat); // for read_battery --cached and the fuel gauge, see sbs_shm.c
+		bat_stat = bat.status; // 16 bit battery status
+        if (!(bat.valid & SBS_STATUS)) // Check for no/bad response from battery
         {
 			go_1(led_cntrl); // turn on blue LED to show errors
 			bad_bat_stat = 1; // status is no good
@@ -280,116 +358,88 @@ int main(void)
 		else if ((bat_stat & 0x1000) == 0x1000)
 		{
 			bad_bat_stat = 0; // status is good
-			over_temp_count++; // increment counter
-			if (over_temp_count >= 4) // check for 4 consecutive loops w/ overtemperature
+			if (!over_temp_since) over_temp_since = now_s(); // start timing it
+			if ((now_s() - over_temp_since) >= over_temp_time) // check for 90 seconds w/ overtemperature
 			{       
 				system("sudo shutdown -h now"); // // unsafe condition requires shutdown
 			}
 		}
 		else
 		{
-			over_temp_count = 0; // reset the over temperature counter
+			over_temp_since = 0; // reset the over temperature timer
 			bad_bat_stat = 0; // status is good
 		}
 	// Only proceed with reading the SoC if discharge bit is set with good status read
 		if (((bat_stat & 0x0040) == 0x0040) & (!bad_bat_stat))
 		{		
             go_0(charge_dis); // keep battery charger enabled, waiting for plug in
-	// Read Battery Relative State of Charge
-			error = 0; // initialize to no error
-			startbus(); // send start condition
-			send8(0x16); // send battery address 0x16 (0x0b w/ write)
-			send8(0x0d); // load soc register pointer 0x0d
-			sendrptstart(); // send repeated start codition				
-			send8(0x17); // send battery address 0x17 (0x0b w/ read)
-			soc = read16(); // read soc low & high bytes
-			stopbus(); // send stop condition
-			if ((soc >= 150) | (error))//check if out of range or any nack's
-			{	// try again 
-				startbus(); // send start condition
-				send8(0x16); // send battery address 0x16 (0x0b w/ write)
-				send8(0x0d); // load register pointer 0x0d
-				sendrptstart(); // send repeated start codition				
-				send8(0x17); // send battery address 0x17 (0x0b w/ read)
-				soc = read16(); //read low & high bytes
-				stopbus(); // send stop condition
-			}
-			// Check the battery State of Charge for the following:
-			// <= 8% causes a safe shutdown (must have been <= 10% on last check).
-			// <= 10% causes the display to blink (must have been <= 12% on last check).
-			// <= 15% turns on the blue LED as a warning (must have been <= 17% on last check).
-			// Keeping track of the old soc is done in case there is a bad smbus read
-			if ((soc <= 8) & (old_soc <= 10)) // check for shutdown condition
+	// Battery Relative State of Charge from the poll, only used if it read OK this check
+			soc = bat.soc;
+			_Bool soc_ok = (bat.valid & SBS_SOC) != 0;
+			predict_update(&bat); // SoC and current into the discharge rate estimate
+			int left = predict_seconds(cutoff_soc); // -1 = no prediction yet
+			// Check the predicted time left for the following:
+			// <= 3 minutes causes a safe shutdown, so does 8% SoC (must have been <= 10% on last check).
+			// <= 8 minutes causes the display to blink.
+			// <= 15 minutes turns on the blue LED as a warning.
+			// The filter smooths over a bad smbus read. Without a prediction
+			// the SoC is checked against 8/10/15% and the last check's SoC
+			// against 10/12/17%, in case there is a bad smbus read. A SoC that
+			// didn't read OK this check isn't looked at at all.
+			_Bool shutdown = (left >= 0) ? (left <= shutdown_left) : (soc_ok & (soc <= 8) & (old_soc <= 10));
+			_Bool lcd = (left >= 0) ? (left <= blink_left) : (soc_ok & (soc <= 10) & (old_soc <= 12));
+			_Bool led = (left >= 0) ? (left <= warn_left) : (soc_ok & (soc <= 15) & (old_soc <= 17));
+			if (shutdown || (soc_ok & (soc <= cutoff_soc) & (old_soc <= cutoff_soc + 2))) // check for shutdown condition
 			{   
 				system("sudo shutdown -h now"); // safe shutdown of Pi
 				// assumes dtoverlay=gpio-poweroff....was added to config.txt
 				// to cause the Pi to send a signal to the Teensy to turn off the power   
 			}
-			else if ((soc <= 10) & (old_soc <= 12)) // check for blink display condition
+			else if (lcd) // check for blink display condition
 			{
-				// blink the display as a warning of low battery power
-				go_0(lcd_pwr); // send video card power signal low to turn it off
-				delay(250); // wait a quarter second 
-				go_z(lcd_pwr); // release power signal so pull up brings it high 
-				delay(2000); // wait 2 seconds
-				go_0(lcd_pwr); // send video card power signal low to turn it on
-				delay(250); // wait a quarter second 
-				go_z(lcd_pwr); // release power signal so pull up brings it high
-				// turn on blue LED
-				go_1(led_cntrl); // turn on blue LED
+				// blink the display as a warning of low battery power, but
+				// only every 30 seconds even when the checks come faster
+				if ((now_s() - last_lcd_blink) >= lcd_blink_time)
+				{
+					last_lcd_blink = now_s();
+					blink(steps(lcd_blink)); // LCD off and on, then blue LED on
+				}
+				else go_1(led_cntrl); // turn on blue LED
 			}
-			else if ((soc <= 15) & (old_soc <= 17)) // soc at 15% or less
+			else if (led) // 15 minutes or less
 			{  // turn on blue LED but blink it off for 1 second each loop
-				go_0(led_cntrl); // turn off blue LED
-				delay(1000); // wait 1 second
-				go_1(led_cntrl); // turn on blue LED
+				blink(steps(warning));
 			}
-			else // soc is above 15% 
+			else // more than 15 minutes left
 			{  // blink blue LED on for 1 second as a heartbeat each loop
-				go_1(led_cntrl); // turn on blue LED
-				delay(1000); // wait 1 second
-				go_0(led_cntrl); // turn off blue LED
+				blink(steps(heartbeat));
 			}
-			old_soc = soc; // save soc as old soc for next loop
+			if (soc_ok) old_soc = soc; // save soc as old soc for next loop
+			period = next_period(soc_ok ? soc : old_soc, left, 1);
 		}
 		else  // charger is plugged in
 		{ 
             // check if "fully charged" status bit is set in the battery status word w/o error				
 			if (((bat_stat & 0x0020) == 0x0020) & (!bad_bat_stat)) {
 				go_1(charge_dis); // battery charger disabled
-				// Blink LED 3 times if status bit says fully charged
-			    go_1(led_cntrl); // turn on blue LED
-			    delay(250); // wait 1/4 second
-			    go_0(led_cntrl); // turn off disk LED
-			    delay(250); // wait 1/4 second
-			    go_1(led_cntrl); // turn on blue LED
-			    delay(250); // wait 1/4 second
-			    go_0(led_cntrl); // turn off disk LED
-			    delay(250); // wait 1/4 second
-			    go_1(led_cntrl); // turn on blue LED
-			    delay(250); // wait 1/4 second
-			    go_0(led_cntrl); // turn off disk LED
+				blink(steps(charged)); // Blink LED 3 times if status bit says fully charged
+				predict_reset(); // start a new discharge estimate when it's unplugged
+				period = next_period(0, 0, 0);
 		    }	
 			else if (!bad_bat_stat) // not fully charged but good status read
 			{   
 				go_0(charge_dis); // battery charger enabled
-				// Blink LED twice if "fully charged" status bit is not set 
-			    go_1(led_cntrl); // turn on blue LED
-			    delay(333); // wait 1/3 second
-			    go_0(led_cntrl); // turn off disk LED
-			    delay(333); // wait 1/3 second
-			    go_1(led_cntrl); // turn on blue LED
-			    delay(333); // wait 1/3 second
-			    go_0(led_cntrl); // turn off disk LED
+				blink(steps(charging)); // Blink LED twice if "fully charged" status bit is not set 
+				predict_reset(); // start a new discharge estimate when it's unplugged
+				period = next_period(0, 0, 0);
 			}
 			else // error reading battery so do nothing
 			{   
 				go_0(charge_dis); // battery charger enabled
 			}
 		}
-		
-	delay(29000);	// wait 30 seconds total before repeating the loop
+		metrics_update(&bat, lag, period); // for the next scrapes
+		check_in(period);
 	}
 	return 0;
 }
-
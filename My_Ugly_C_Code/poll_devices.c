@@ -0,0 +1,339 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Polls every SMBus device on a rig, ie the battery, a smart charger and
+// a second pack, each at its own rate, and prints one line per poll.
+//
+// Buses are given with -b, numbered from 0 in the order given:
+//     -b 3,2                  bit-bang, clock GPIO 3 and data GPIO 2
+//     -b /dev/gpiomem:23,24   bit-bang through the GPIO registers
+//     -b /dev/i2c-1           kernel driver
+//     -b /run/smbus_broker.sock
+// A -c cpu before a -b pins that bus's worker to the CPU. Two bit-bang
+// buses need their pins in different groups of ten (see smbus.c).
+//
+// Devices are given with -p bus,address,kind,seconds[,registers], ie
+//     -p 0,0x0b,battery,10    the battery on bus 0 every 10 seconds
+//     -p 0,0x09,charger,2.5   the charger on bus 0 every 2.5 seconds
+//     -p 1,0x0b,battery,1,voltage+current+soc   just those, every second
+// Each device has its own poll plan. The registers are named the same
+// as in the output lines and joined with +. Without a list a battery
+// gets every word register in sbs.h and a charger every register in
+// the table below. A battery poll is sbs_cached() with the plan, so the
+// ones that don't change much come from the cache, and battery status
+// is always read since that is how a missing pack shows up. The
+// battery's block registers (manufacturer, device_name) are only read
+// when they are asked for.
+//
+// Every device gets its own thread, which sets its bus and address with
+// use_bus() and use_device() and then sleeps to an absolute time between
+// polls, so the rate doesn't drift. Devices on the same bus take turns
+// one transaction at a time. Each bit-bang bus has its own worker, so
+// polls on different buses run at the same time and adding a second
+// pack on its own pins doesn't stretch the battery's sampling period.
+//
+// Each line is the time, bus, address, kind, the fields read and how
+// long the poll held the bus. With -n the program stops after that many
+// polls of each device and prints each bus's timing (bus_stats()).
+//
+// Usage:
+//     sudo ./poll_devices -b 3,2 -p 0,0x0b,battery,10 -p 0,0x09,charger,5,status [-c cpu] [-t tracefile] [-n polls]
+// Build:
+//     gcc -o poll_devices poll_devices.c sbs.c smbus.c -l wiringPi -l pthread
+// or against the battery simulator on a PC (see sim/fake_gpio.c):
+//     gcc -funsigned-char -I sim -o poll_devices poll_devices.c sbs.c smbus.c sim/fake_gpio.c sim/sbs_slave.c sim/battery_model.c -l pthread -l m
+//
+// Rev 1.0 - Feb 2021 - Original release
+// Rev 1.1 - Mar 2021 - Poll plan per device
+//
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "smbus.h"
+#include "sbs.h"
+
+#define max_devices 16
+
+// Smart Battery Charger registers. Columns: name, register, printf
+// format. ChargingCurrent (mA) and ChargingVoltage (mV) are what the
+// battery last asked the charger for.
+#define CHARGER_REGISTERS(X) \
+	X(spec_info,        0x11, "%#06x") \
+	X(status,           0x13, "%#06x") \
+	X(charging_current, 0x14, "%u") \
+	X(charging_voltage, 0x15, "%u")
+#define charger_tries 2
+
+#define CHARGER_ENTRY(field, reg, format) {#field, reg, format},
+static const struct {
+	const char *name;
+	unsigned char reg;
+	const char *format;
+} charger_regs[] = { CHARGER_REGISTERS(CHARGER_ENTRY) };
+#undef CHARGER_ENTRY
+
+// Battery fields to print, in the display units of the table in sbs.h
+#define BATTERY_ENTRY(NAME, field, reg, type, scale, offset, min, max, flags, age, tries, label, format, unit) \
+	{SBS_##NAME, #field, format, sbs_##field},
+static const struct {
+	unsigned int bit;
+	const char *name;
+	const char *format;
+	double (*decode)(const struct sbs_snapshot *snap);
+} battery_fields[] = { SBS_WORD_REGISTERS(BATTERY_ENTRY) };
+#undef BATTERY_ENTRY
+#define BLOCK_ENTRY(NAME, field, reg, label) {SBS_##NAME, #field, offsetof(struct sbs_snapshot, field)},
+static const struct {
+	unsigned int bit;
+	const char *name;
+	size_t offset;
+} block_fields[] = { SBS_BLOCK_REGISTERS(BLOCK_ENTRY) };
+#undef BLOCK_ENTRY
+#define count_of(table) (sizeof(table) / sizeof(table[0]))
+
+static struct {
+	const char *device; // setupbus() style device, NULL = bit-bang with wiringPi
+	int clock, data;
+	int cpu; // bus_cpu for its worker
+} bus_list[SMBUS_MAX_BUSES];
+static int bus_total = 0;
+
+static struct {
+	int bus;
+	unsigned char address;
+	_Bool charger; // 0 = battery
+	double period; // seconds between polls
+	unsigned int plan; // registers to read, SBS_ flags for a battery, bit i for charger_regs[i]
+	pthread_t thread;
+} dev_list[max_devices];
+static int dev_total = 0;
+static int polls = 0; // -n, 0 = forever
+static struct timespec start; // CLOCK_MONOTONIC, first poll of every device
+
+// Functions
+static double since_start(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+//
+struct line { // one line of output, built up a field at a time
+	char text[1024];
+	int len;
+};
+//
+static void put(struct line *line, const char *format, ...) // add to the line, cut short if it's full
+{
+	va_list args;
+	int room = sizeof(line->text) - line->len;
+	va_start(args, format);
+	int n = vsnprintf(line->text + line->len, room, format, args);
+	va_end(args);
+	if (n > 0) line->len += (n < room) ? n : room - 1;
+}
+//
+static void poll_battery(struct line *line, unsigned int plan)
+{
+	struct sbs_snapshot snap;
+	sbs_cached(plan | SBS_STATUS, &snap);
+	if (!(snap.valid & SBS_STATUS)) {
+	  put(line, " not answering bus_us=%u", snap.bus_us);
+	  return;
+	}
+	for (unsigned int i=0; i<count_of(battery_fields); i++) {
+	  if (!(plan & battery_fields[i].bit)) continue; // not in this device's plan
+	  if (!(snap.valid & battery_fields[i].bit)) {
+		put(line, " %s=bad", battery_fields[i].name);
+		continue;
+	  }
+	  put(line, " %s=", battery_fields[i].name);
+	  if (battery_fields[i].bit == SBS_STATUS) put(line, "%#06x", snap.status); // raw bits
+	  else put(line, battery_fields[i].format, battery_fields[i].decode(&snap));
+	}
+	for (unsigned int i=0; i<count_of(block_fields); i++) {
+	  if (!(plan & block_fields[i].bit)) continue;
+	  if (snap.valid & block_fields[i].bit) put(line, " %s=\"%s\"", block_fields[i].name, (const char *)&snap + block_fields[i].offset);
+	  else put(line, " %s=bad", block_fields[i].name);
+	}
+	put(line, " bus_us=%u", snap.bus_us);
+}
+//
+static void poll_charger(struct line *line, unsigned int plan)
+{
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (unsigned int i=0; i<count_of(charger_regs); i++) {
+	  if (!(plan & (1u << i))) continue; // not in this device's plan
+	  unsigned short value = 0xffff;
+	  for (int attempt=0; attempt<charger_tries; attempt++) {
+		value = read_word(charger_regs[i].reg);
+		if (!error) break;
+	  }
+	  put(line, " %s=", charger_regs[i].name);
+	  if (error) put(line, "bad");
+	  else put(line, charger_regs[i].format, value);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	put(line, " bus_us=%ld", (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000);
+}
+//
+static void *device_loop(void *arg) // polls one device at its own rate
+{
+	int d = (int)(long)arg;
+	use_bus(dev_list[d].bus); // everything this thread sends goes to this bus and device
+	use_device(dev_list[d].address);
+	struct timespec next = start;
+	long step_ns = (long)(dev_list[d].period * 1e9);
+	for (int count=0; (polls == 0) || (count < polls); count++) {
+	  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	  struct line line = {.len = 0};
+	  put(&line, "%.3f bus%d 0x%02x %s", since_start(), dev_list[d].bus,
+		dev_list[d].address, dev_list[d].charger ? "charger" : "battery");
+	  if (dev_list[d].charger) poll_charger(&line, dev_list[d].plan);
+	  else poll_battery(&line, dev_list[d].plan);
+	  put(&line, "\n");
+	  fputs(line.text, stdout); // one call, so lines from two devices don't get mixed
+	  fflush(stdout);
+	  next.tv_sec += step_ns / 1000000000;
+	  next.tv_nsec += step_ns % 1000000000;
+	  if (next.tv_nsec >= 1000000000) {
+		next.tv_sec++;
+		next.tv_nsec -= 1000000000;
+	  }
+	}
+	return NULL;
+}
+//
+static int add_bus(char *spec, int cpu) // -b [device:]clock,data or -b device
+{
+	if (bus_total == SMBUS_MAX_BUSES) return -1;
+	char *pins = spec;
+	bus_list[bus_total].device = NULL;
+	if (spec[0] == '/') { // a device path, maybe with pins after a colon
+	  bus_list[bus_total].device = spec;
+	  pins = strchr(spec, ':');
+	  if (pins) *pins++ = 0;
+	}
+	bus_list[bus_total].clock = 3; // GPIO 3 and 2 unless given
+	bus_list[bus_total].data = 2;
+	if (pins && (sscanf(pins, "%d,%d", &bus_list[bus_total].clock, &bus_list[bus_total].data) != 2)) return -1;
+	bus_list[bus_total].cpu = cpu;
+	bus_total++;
+	return 0;
+}
+//
+static unsigned int register_bit(_Bool charger, const char *name) // plan bit for a register name, 0 = no such register
+{
+	if (charger) {
+	  for (unsigned int i=0; i<count_of(charger_regs); i++) {
+		if (!strcmp(name, charger_regs[i].name)) return 1u << i;
+	  }
+	  return 0;
+	}
+	for (unsigned int i=0; i<count_of(battery_fields); i++) {
+	  if (!strcmp(name, battery_fields[i].name)) return battery_fields[i].bit;
+	}
+	for (unsigned int i=0; i<count_of(block_fields); i++) {
+	  if (!strcmp(name, block_fields[i].name)) return block_fields[i].bit;
+	}
+	return 0;
+}
+//
+static int add_device(char *spec) // -p bus,address,kind,seconds[,register+register...]
+{
+	char kind[16];
+	int bus;
+	unsigned int address;
+	double period;
+	int end = 0;
+	if (dev_total == max_devices) return -1;
+	if ((sscanf(spec, "%d,%i,%15[a-z],%lf%n", &bus, &address, kind, &period, &end) != 4) || (end == 0)) return -1;
+	if ((address > 0x7f) || (period <= 0)) return -1;
+	if (strcmp(kind, "battery") && strcmp(kind, "charger")) return -1;
+	_Bool charger = (strcmp(kind, "charger") == 0);
+	unsigned int plan = charger ? (1u << count_of(charger_regs)) - 1 : SBS_ALL_WORDS; // everything it has
+	if (spec[end] == ',') { // just these
+	  char *save;
+	  plan = 0;
+	  for (char *name = strtok_r(spec + end + 1, "+", &save); name; name = strtok_r(NULL, "+", &save)) {
+		unsigned int bit = register_bit(charger, name);
+		if (!bit)
+		{
+			fprintf(stderr, "poll_devices: no %s register called %s\n", kind, name);
+			return -1;
+		}
+		plan |= bit;
+	  }
+	  if (!plan) return -1;
+	}
+	else if (spec[end] != 0) return -1;
+	dev_list[dev_total].bus = bus;
+	dev_list[dev_total].address = address;
+	dev_list[dev_total].charger = charger;
+	dev_list[dev_total].period = period;
+	dev_list[dev_total].plan = plan;
+	dev_total++;
+	return 0;
+}
+//
+// Main program
+int main(int argc, char *argv[])
+{
+	int opt;
+	int cpu = -1; // for the next -b
+	_Bool bad = 0;
+	while ((opt = getopt(argc, argv, "b:c:p:t:n:")) != -1)
+	{
+		if (opt == 'b') bad |= (add_bus(optarg, cpu) != 0); // a bus, numbered in order
+		else if (opt == 'c') cpu = atoi(optarg); // pin the next bus's worker to this CPU
+		else if (opt == 'p') bad |= (add_device(optarg) != 0); // a device to poll
+		else if (opt == 't') bus_trace = optarg; // dump failed bit-bang transactions as VCD files
+		else if (opt == 'n') polls = atoi(optarg); // polls of each device, then quit
+		else bad = 1;
+	}
+	for (int d=0; d<dev_total; d++) {
+	  if (dev_list[d].bus >= bus_total) bad = 1; // no such bus
+	}
+	if (bad || (dev_total == 0) || (optind != argc))
+	{
+		fprintf(stderr, "Usage: %s -b [device:]clock,data | -b device ... -p bus,address,battery|charger,seconds[,reg+reg...] ... [-c cpu] [-t tracefile] [-n polls]\n", argv[0]);
+		return 1;
+	}
+	for (int b=0; b<bus_total; b++) {
+	  bus_cpu = bus_list[b].cpu;
+	  if (openbus(bus_list[b].device, bus_list[b].clock, bus_list[b].data) != b) return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int d=0; d<dev_total; d++) {
+	  if (pthread_create(&dev_list[d].thread, NULL, device_loop, (void *)(long)d))
+	  {
+		perror("pthread_create");
+		return 1;
+	  }
+	}
+	for (int d=0; d<dev_total; d++) {
+	  pthread_join(dev_list[d].thread, NULL); // only comes back with -n
+	}
+	for (int b=0; b<bus_total; b++) {
+	  printf("Bus %d\n", b);
+	  use_bus(b);
+	  bus_stats(stdout);
+	}
+	return 0;
+}
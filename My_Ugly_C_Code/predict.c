@@ -0,0 +1,131 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Discharge rate estimator. The state of charge register only moves in
+// whole percent and a check only comes every few seconds, so a rule
+// like "shut down at 8%" is either too early when the Pi is idle or too
+// late when it is busy. This keeps a small Kalman filter with two
+// states, the SoC and how fast it is changing (percent per second):
+//
+// - Between checks the SoC moves by rate * time, and the rate is allowed
+//   to wander (rate_noise) since the Pi's load changes.
+// - Each check's SoC register corrects the SoC (soc_noise covers the
+//   1% steps).
+// - When the current and full charge capacity were read OK, the current
+//   is turned into a rate (mA / mAh * 100 / 3600) and corrects the rate
+//   directly, so a jump in load shows up on the next check instead of
+//   after the next 1% step.
+//
+// predict_seconds() is then how long until the SoC gets down to a
+// cutoff at the estimated rate. monitor_battery uses it for the LED,
+// LCD and shutdown warnings and to check faster near the end.
+//
+// Each update is a few dozen multiplies, no history is kept.
+//
+// Rev 1.0 - Feb 2021 - Original release
+//
+#include <math.h>
+#include <time.h>
+#include "sbs.h"
+#include "predict.h"
+
+#define soc_noise 0.5 // percent, 1 sigma of the SoC register
+#define current_noise 0.3 // fraction of the rate, 1 sigma of a rate from the current (it's spiky)
+#define rate_noise 4e-7 // (percent/s)^2 per second, how fast the rate can wander
+#define start_rate_sigma 0.02 // percent/s, how unsure the first rate is
+#define min_rate 1e-5 // percent/s, slower than this counts as not discharging
+
+static double soc, rate; // state, percent and percent/s
+static double p00, p01, p11; // covariance of soc and rate
+static struct timespec last; // monotonic time of the last update
+static int updates = 0; // 0 = nothing yet
+static _Bool rate_seen = 0; // a current reading or two SoC readings have set the rate
+static unsigned int pack; // sbs_pack the history belongs to
+
+// Functions
+void predict_reset(void)
+{
+	updates = 0;
+	rate_seen = 0;
+}
+//
+static void correct_soc(double z, double noise) // measurement of the SoC
+{
+	double s = p00 + noise * noise;
+	double k0 = p00 / s, k1 = p01 / s;
+	double y = z - soc;
+	soc += k0 * y;
+	rate += k1 * y;
+	p11 -= k1 * p01; // uses the old p01
+	p00 -= k0 * p00;
+	p01 -= k0 * p01;
+}
+//
+static void correct_rate(double z, double noise) // measurement of the rate
+{
+	double s = p11 + noise * noise;
+	double k0 = p01 / s, k1 = p11 / s;
+	double y = z - rate;
+	soc += k0 * y;
+	rate += k1 * y;
+	p00 -= k0 * p01; // uses the old p01 and p11
+	p01 -= k0 * p11;
+	p11 -= k1 * p11;
+}
+//
+void predict_update(const struct sbs_snapshot *snap)
+{
+	if (!(snap->valid & SBS_SOC)) return; // nothing to go on
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now); // the wall clock jumps when NTP sets it
+	if (pack != sbs_pack) predict_reset(); // new battery
+	pack = sbs_pack;
+	_Bool have_current = ((snap->valid & (SBS_CURRENT | SBS_FULL_CAPACITY)) == (SBS_CURRENT | SBS_FULL_CAPACITY));
+	double measured = have_current ? snap->current * 100.0 / (snap->full_capacity * 3600.0) : 0;
+	if (updates == 0) { // start from this check
+	  soc = snap->soc;
+	  rate = measured;
+	  p00 = soc_noise * soc_noise;
+	  p01 = 0;
+	  p11 = start_rate_sigma * start_rate_sigma;
+	}
+	else { // move the estimate up to now
+	  double dt = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+	  soc += rate * dt;
+	  p00 += dt * (2 * p01 + dt * p11) + rate_noise * dt * dt * dt / 3;
+	  p01 += dt * p11 + rate_noise * dt * dt / 2;
+	  p11 += rate_noise * dt;
+	  correct_soc(snap->soc, soc_noise);
+	  rate_seen = 1;
+	}
+	if (have_current) {
+	  correct_rate(measured, current_noise * fabs(measured) + min_rate);
+	  rate_seen = 1;
+	}
+	last = now;
+	updates++;
+}
+//
+double predict_rate(void)
+{
+	return rate_seen ? rate : 0;
+}
+//
+int predict_seconds(int cutoff)
+{
+	if (!rate_seen || (rate > -min_rate)) return -1; // no estimate, or not running down
+	double left = (soc - cutoff) / -rate;
+	if (left < 0) return 0;
+	if (left > 86400) return 86400; // a day, as good as forever
+	return (int)left;
+}
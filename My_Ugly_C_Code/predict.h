@@ -0,0 +1,27 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Discharge rate estimator, predicts how long until the battery is
+// empty. See predict.c.
+//
+#ifndef PREDICT_H
+#define PREDICT_H
+
+#include "sbs.h"
+
+void predict_reset(void); // forget the history, ie when the charger is plugged in
+void predict_update(const struct sbs_snapshot *snap); // add a check, needs SoC, uses current and full capacity
+double predict_rate(void); // estimated SoC change in percent per second, negative when discharging
+int predict_seconds(int cutoff); // seconds until SoC gets down to cutoff percent, -1 = not known yet
+
+#endif
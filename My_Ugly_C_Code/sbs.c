@@ -0,0 +1,441 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// libsbs - Smart Battery register access for read_battery,
+// read_battery_loop and monitor_battery. It is this file plus smbus.c.
+// The registers themselves are described once, in the table in sbs.h,
+// and everything else here is generated from that table.
+//
+// Poll plan. A full read used to be seven separate
+// read-and-maybe-read-again blocks spread through each program, each
+// taken at a different moment. sbs_poll() takes the set of registers
+// the caller needs, reads them back-to-back with only the SMBus bus free
+// time between transactions, and hands back one snapshot with a valid
+// bit per field plus when it was taken and how long the bus was busy.
+//
+// Battery status is read first. If it fails every try the battery isn't
+// answering and the rest of the plan is skipped. Each register is read
+// again if it NACKs, fails its PEC or (for batteries without PEC) is
+// FFFF or outside its plausibility window, up to the number of tries in
+// the table. The wait before each retry doubles, starting at 0.5 ms and
+// never more than 8 ms, to give a busy gauge time to finish. The last
+// value read is stored even if it is not valid. Every bad read is
+// counted in sbs_stats[] by register and by cause (which byte was NACKed,
+// clock timeout, PEC, all ones or out of range), so it shows where bus
+// time goes. sbs_print_stats() prints them.
+//
+// SBS word registers can only be read one at a time, so the block reads
+// are used for the name registers, which come back in one transaction.
+//
+// Build the library once and link the programs against it:
+//     gcc -c sbs.c smbus.c telemetry.c sbs_shm.c
+//     ar rcs libsbs.a sbs.o smbus.o telemetry.o sbs_shm.o
+//     gcc -o read_battery read_battery.c -L. -lsbs -lwiringPi -lpthread -lrt
+//
+// Register cache. Most of what a battery reports doesn't change between
+// polls: the design capacity, serial number and names only change when
+// the pack does and full charge capacity drifts over weeks. sbs_cached()
+// keeps the last good value of every register with the time it was read
+// and only goes to the bus for registers older than their max age (from
+// the table in sbs.h, or sbs_max_age()). Battery status is always read,
+// it is how a missing battery shows up. The serial number is read
+// whenever it is due, even if the caller didn't ask for it.
+// A pack swap is seen as battery status failing (pack pulled out) or
+// the serial number changing (pack swapped between two polls). Either
+// way the whole cache is thrown away, sbs_pack goes up, PEC is probed
+// again for the new pack and everything asked for is read fresh. With
+// PEC on, a failed status read is probed again before the pack is given
+// up on, because a new pack without PEC fails every read until then.
+//
+// The counters, the cache and sbs_pack belong to the thread, like the
+// bus state in smbus.c, so a program with one thread per battery (each
+// with its own use_bus() and use_device()) keeps the packs apart. The
+// retry and max age settings are shared.
+//
+// Rev 1.0 - Feb 2021 - Original release
+// Rev 1.1 - Feb 2021 - Register table, decoders and printer (libsbs)
+// Rev 1.2 - Feb 2021 - Register cache with a max age per register
+// Rev 1.3 - Feb 2021 - Retry policy per register, error causes and counters
+// Rev 1.4 - Feb 2021 - Cache and counters per thread, for more than one pack
+// Rev 1.5 - Mar 2021 - PEC probed again when battery status fails
+//
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "smbus.h"
+#include "sbs.h"
+
+// Word registers in the order they are read, built from the table in sbs.h
+#define SBS_WORD_ENTRY(NAME, field, reg, type, scale, offset, min, max, flags, age, tries, label, format, unit) \
+	{SBS_##NAME, reg, offsetof(struct sbs_snapshot, field), sbs_plausible_##field, sbs_##field, flags, age, label, format, unit},
+static const struct {
+	unsigned int bit; // SBS_ flag for the plan and valid mask
+	unsigned char reg; // register pointer
+	size_t offset; // where the value goes in the snapshot
+	_Bool (*plausible)(unsigned short raw); // range check for batteries without PEC
+	double (*decode)(const struct sbs_snapshot *snap); // raw value to display units
+	int flags; // SBS_ONES_OK, SBS_HIDE
+	int age; // default max age in the cache, seconds
+	const char *label, *format, *unit; // for sbs_print()
+} words[] = {
+	SBS_WORD_REGISTERS(SBS_WORD_ENTRY)
+};
+#undef SBS_WORD_ENTRY
+#define word_count (sizeof(words) / sizeof(words[0]))
+
+// Block (string) registers
+#define SBS_BLOCK_ENTRY(NAME, field, reg, label) \
+	{SBS_##NAME, reg, offsetof(struct sbs_snapshot, field), label},
+static const struct {
+	unsigned int bit;
+	unsigned char reg;
+	size_t offset;
+	const char *label;
+} blocks[] = {
+	SBS_BLOCK_REGISTERS(SBS_BLOCK_ENTRY)
+};
+#undef SBS_BLOCK_ENTRY
+#define block_count (sizeof(blocks) / sizeof(blocks[0]))
+
+// Battery status bits
+#define SBS_STATUS_ENTRY(mask, text) {mask, text},
+static const struct {
+	unsigned short mask;
+	const char *text;
+} status_bits[] = {
+	SBS_STATUS_BITS(SBS_STATUS_ENTRY)
+};
+#undef SBS_STATUS_ENTRY
+
+// Retry policy and counters
+#define retry_wait 500 // usec before the second try, doubled for each one after
+#define retry_wait_max 8000 // longest wait between tries (usec)
+#define SBS_TRIES_ENTRY(NAME, field, reg, type, scale, offset, min, max, flags, age, tries, ...) tries,
+#define SBS_BLOCK_TRIES(...) sbs_block_tries,
+static int tries[SBS_REGISTER_COUNT] = { // from the table in sbs.h
+	SBS_WORD_REGISTERS(SBS_TRIES_ENTRY) SBS_BLOCK_REGISTERS(SBS_BLOCK_TRIES)
+};
+#undef SBS_TRIES_ENTRY
+#undef SBS_BLOCK_TRIES
+#define SBS_TRIES_CHECK(NAME, field, reg, type, scale, offset, min, max, flags, age, tries, ...) \
+	_Static_assert((tries) >= 1, #NAME " has to be read at least once");
+SBS_WORD_REGISTERS(SBS_TRIES_CHECK)
+#undef SBS_TRIES_CHECK
+_Static_assert(sbs_block_tries >= 1, "block registers have to be read at least once");
+__thread struct sbs_stats sbs_stats[SBS_REGISTER_COUNT];
+static const char *error_names[SBS_ERRORS] = {
+	[SMBUS_OK] = "OK",
+	[SMBUS_ADDR_NACK] = "address NACK",
+	[SMBUS_REG_NACK] = "register NACK",
+	[SMBUS_READ_NACK] = "read address NACK",
+	[SMBUS_DATA_NACK] = "data NACK",
+	[SMBUS_TIMEOUT] = "clock timeout",
+	[SMBUS_PEC] = "PEC mismatch",
+	[SMBUS_FAILED] = "failed",
+	[SBS_ALL_ONES] = "all ones",
+	[SBS_OUT_OF_RANGE] = "out of range",
+};
+
+// Functions
+const char *sbs_error_name(int why)
+{
+	if ((why < 0) || (why >= SBS_ERRORS)) return "?";
+	return error_names[why];
+}
+//
+void sbs_retry(unsigned int regs, int n)
+{
+	for (int i=0; i<SBS_REGISTER_COUNT; i++) {
+	  if (regs & (1u << i)) tries[i] = (n < 1) ? 1 : n;
+	}
+}
+//
+static int check(int i, unsigned short value) // why a word read is no good, SMBUS_OK if it is believable
+{
+	if (error) return (bus_error != SMBUS_OK) ? bus_error : SMBUS_FAILED; // NACK, timeout or PEC mismatch
+	if (pec) return SMBUS_OK; // PEC matched so the value is what the battery sent
+	if (words[i].plausible(value)) return SMBUS_OK;
+	return (value == 0xffff) ? SBS_ALL_ONES : SBS_OUT_OF_RANGE;
+}
+//
+static void back_off(int attempt) // bounded exponential wait before another try
+{
+	unsigned int us = retry_wait << (attempt - 1);
+	if (us > retry_wait_max) us = retry_wait_max;
+	usleep(us); // gives a busy gauge time to finish what it is doing
+}
+//
+static int read_word_reg(int i, unsigned short *value) // read word register i with its retry policy
+{
+	int why = SMBUS_FAILED; // in case it never gets read
+	*value = 0xffff;
+	for (int attempt=0; attempt<tries[i]; attempt++) {
+	  if (attempt) {
+		sbs_stats[i].retries++;
+		back_off(attempt);
+	  }
+	  sbs_stats[i].reads++;
+	  *value = read_word(words[i].reg); // the last value read is kept, good or bad
+	  why = check(i, *value);
+	  if (why == SMBUS_OK) return why;
+	  sbs_stats[i].why[why]++;
+	}
+	sbs_stats[i].failed++;
+	return why;
+}
+//
+static int read_block_reg(int b, char *text) // read block register b with its retry policy, text gets null terminated
+{
+	int i = word_count + b; // blocks come after the words in the tables
+	int why = SMBUS_FAILED; // in case it never gets read
+	for (int attempt=0; attempt<tries[i]; attempt++) {
+	  if (attempt) {
+		sbs_stats[i].retries++;
+		back_off(attempt);
+	  }
+	  sbs_stats[i].reads++;
+	  int count = read_block(blocks[b].reg, (unsigned char *)text, 32);
+	  if (count >= 0) {
+		text[count] = 0; // block reads aren't null terminated
+		return SMBUS_OK;
+	  }
+	  why = (bus_error != SMBUS_OK) ? bus_error : SMBUS_FAILED;
+	  sbs_stats[i].why[why]++;
+	}
+	text[0] = 0;
+	sbs_stats[i].failed++;
+	return why;
+}
+//
+static unsigned int total_retries(void) // this thread's retries of every register so far
+{
+	unsigned int n = 0;
+	for (int i=0; i<SBS_REGISTER_COUNT; i++) n += sbs_stats[i].retries;
+	return n;
+}
+//
+int sbs_poll(unsigned int plan, struct sbs_snapshot *snap)
+{
+	struct timespec start, end;
+	int good = 0; // fields read OK
+	unsigned int retries = total_retries();
+	memset(snap, 0, sizeof(*snap));
+	clock_gettime(CLOCK_REALTIME, &snap->when);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned int i=0; i<word_count; i++) {
+	  if (!(plan & words[i].bit)) continue; // not in the plan
+	  unsigned short value;
+	  int why = read_word_reg(i, &value);
+	  *(unsigned short *)((char *)snap + words[i].offset) = value;
+	  if (why == SMBUS_OK) {
+		snap->valid |= words[i].bit;
+		good++;
+	  }
+	  else if (words[i].bit == SBS_STATUS) {
+		plan = 0; // battery isn't answering, don't bother with the rest
+	  }
+	}
+	for (unsigned int i=0; i<block_count; i++) {
+	  if (!(plan & blocks[i].bit)) continue;
+	  if (read_block_reg(i, (char *)snap + blocks[i].offset) == SMBUS_OK) {
+		snap->valid |= blocks[i].bit;
+		good++;
+	  }
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	snap->bus_us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+	snap->retries = total_retries() - retries;
+	return good;
+}
+//
+void sbs_print_stats(FILE *out) // one line per register that has been read
+{
+	for (int i=0; i<SBS_REGISTER_COUNT; i++) {
+	  const struct sbs_stats *st = &sbs_stats[i];
+	  if (st->reads == 0) continue;
+	  fprintf(out, "%s: %u reads, %u retries, %u failed",
+		(i < (int)word_count) ? words[i].label : blocks[i - word_count].label,
+		st->reads, st->retries, st->failed);
+	  const char *sep = " (";
+	  for (int why=1; why<SBS_ERRORS; why++) {
+		if (st->why[why] == 0) continue;
+		fprintf(out, "%s%s %u", sep, error_names[why], st->why[why]);
+		sep = ", ";
+	  }
+	  fprintf(out, "%s\n", (*sep == ',') ? ")" : "");
+	}
+}
+//
+void sbs_print(FILE *out, const struct sbs_snapshot *snap, unsigned int plan) // same text read_battery always showed
+{
+	if (!(snap->valid & SBS_STATUS))
+	{
+		fprintf(out, "The battery did not respond\n");
+		return;
+	}
+	for (unsigned int i=0; i<word_count; i++) {
+	  if (!(plan & words[i].bit) || (words[i].bit == SBS_STATUS)) continue; // status goes last
+	  unsigned short raw = *(const unsigned short *)((const char *)snap + words[i].offset);
+	  if (!(snap->valid & words[i].bit)) {
+		if (!(words[i].flags & SBS_HIDE)) {
+		  fprintf(out, "%s = bad read\n", words[i].label);
+		}
+		continue;
+	  }
+	  // Don't show FFFF minutes and the like when they only mean "not now"
+	  if ((words[i].flags & SBS_HIDE) && ((raw == 0xffff) || !words[i].plausible(raw))) continue;
+	  fprintf(out, "%s = ", words[i].label);
+	  fprintf(out, words[i].format, words[i].decode(snap));
+	  fprintf(out, *words[i].unit ? " %s\n" : "%s\n", words[i].unit);
+	}
+	for (unsigned int i=0; i<block_count; i++) {
+	  if (plan & snap->valid & blocks[i].bit) {
+		fprintf(out, "%s = %s\n", blocks[i].label, (const char *)snap + blocks[i].offset);
+	  }
+	}
+	fprintf(out, "%s = ", words[SBS_INDEX_STATUS].label);
+	fprintf(out, words[SBS_INDEX_STATUS].format, snap->status); // shown in hex
+	fprintf(out, " %s\n", words[SBS_INDEX_STATUS].unit);
+	for (unsigned int i=0; i<sizeof(status_bits) / sizeof(status_bits[0]); i++) {
+	  if ((snap->status & status_bits[i].mask) == status_bits[i].mask) {
+		fprintf(out, "   %s\n", status_bits[i].text);
+	  }
+	}
+	if ((plan & SBS_PRINT_UNKNOWN) && ((snap->status & SBS_STATUS_UNKNOWN) != 0x0000)) { // check if unknown bits set
+	  fprintf(out, "   Unknown\n");
+	}
+}
+//
+// Register cache
+__thread unsigned int sbs_pack = 0; // new pack count, 0 until a battery has been seen
+static __thread struct sbs_snapshot cache; // last value read of every register, valid bits as read
+static __thread struct timespec read_at[SBS_REGISTER_COUNT]; // when each one was read (CLOCK_MONOTONIC)
+#define SBS_AGE_ENTRY(NAME, field, reg, type, scale, offset, min, max, flags, age, ...) age,
+#define SBS_BLOCK_AGE(...) SBS_FOREVER,
+static int max_age[SBS_REGISTER_COUNT] = { // seconds, from the table in sbs.h
+	SBS_WORD_REGISTERS(SBS_AGE_ENTRY) SBS_BLOCK_REGISTERS(SBS_BLOCK_AGE)
+};
+#undef SBS_AGE_ENTRY
+#undef SBS_BLOCK_AGE
+//
+void sbs_max_age(unsigned int regs, int seconds)
+{
+	for (int i=0; i<SBS_REGISTER_COUNT; i++) {
+	  if (regs & (1u << i)) max_age[i] = seconds;
+	}
+}
+//
+void sbs_invalidate(void)
+{
+	cache.valid = 0; // everything gets read again on the next sbs_cached()
+}
+//
+static _Bool too_old(int i, const struct timespec *now) // older than its max age?
+{
+	if ((read_at[i].tv_sec == 0) && (read_at[i].tv_nsec == 0)) return 1; // never read
+	if (max_age[i] == SBS_FOREVER) return 0; // only a new pack changes it
+	return (now->tv_sec - read_at[i].tv_sec) >= max_age[i];
+}
+//
+static unsigned int stale(unsigned int plan) // registers in the plan that have to be read again
+{
+	struct timespec now;
+	unsigned int due = 0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (int i=0; i<SBS_REGISTER_COUNT; i++) {
+	  unsigned int bit = 1u << i;
+	  if ((plan & bit) && (!(cache.valid & bit) || too_old(i, &now))) {
+		due |= bit;
+	  }
+	}
+	return due;
+}
+//
+static void store(const struct sbs_snapshot *fresh, unsigned int read) // copy a poll into the cache
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (unsigned int i=0; i<word_count; i++) {
+	  if (!(read & words[i].bit)) continue;
+	  memcpy((char *)&cache + words[i].offset, (const char *)fresh + words[i].offset, sizeof(unsigned short));
+	  read_at[i] = now;
+	}
+	for (unsigned int i=0; i<block_count; i++) {
+	  if (!(read & blocks[i].bit)) continue;
+	  memcpy((char *)&cache + blocks[i].offset, (const char *)fresh + blocks[i].offset, sizeof(cache.manufacturer));
+	  read_at[word_count + i] = now;
+	}
+	cache.valid = (cache.valid & ~read) | (fresh->valid & read);
+}
+//
+int sbs_cached(unsigned int plan, struct sbs_snapshot *snap)
+{
+	struct sbs_snapshot fresh;
+	unsigned int bus_us, retries;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	// First make sure it is still the same battery. A pack without a
+	// serial number only gets asked for one every max age, not every time.
+	unsigned int check = SBS_STATUS;
+	if (too_old(SBS_INDEX_SERIAL_NUMBER, &now)) check |= SBS_SERIAL_NUMBER;
+	sbs_poll(check, &fresh);
+	bus_us = fresh.bus_us;
+	retries = fresh.retries;
+	_Bool pec_lost = 0;
+	if (!(fresh.valid & SBS_STATUS) && pec) {
+		// A pack without PEC fails every read while PEC is on, so it
+		// would look like no battery at all. Probe again and, if that
+		// found PEC off, it is a new pack. Give status one more try.
+		// A probe that couldn't tell (or the broker refused) changes
+		// nothing, status just failed this time.
+		if (!pec_probe() && !error) {
+			pec_lost = 1;
+			sbs_poll(check, &fresh);
+			bus_us += fresh.bus_us;
+			retries += fresh.retries;
+		}
+	}
+	if (!(fresh.valid & SBS_STATUS)) {
+		cache.valid = 0; // battery pulled out (or not answering), forget it
+		store(&fresh, SBS_STATUS); // keep the bad status so the caller sees it
+	}
+	else {
+		_Bool swapped = (fresh.valid & cache.valid & SBS_SERIAL_NUMBER) &&
+			(fresh.serial_number != cache.serial_number);
+		if (!(cache.valid & SBS_STATUS) || swapped || pec_lost) { // first good read of this pack
+			cache.valid = 0;
+			sbs_pack++;
+			pec_probe(); // the new pack may not do PEC (or may, when the old one didn't)
+			memset(read_at, 0, sizeof(read_at)); // never read
+			check = SBS_STATUS; // read the rest again, now with the right PEC setting
+		}
+		store(&fresh, check);
+		// Then read whatever is too old
+		unsigned int due = stale(plan & ~SBS_STATUS);
+		if (due) {
+			sbs_poll(due, &fresh);
+			bus_us += fresh.bus_us;
+			retries += fresh.retries;
+			store(&fresh, due);
+		}
+	}
+	*snap = cache;
+	snap->valid &= plan;
+	clock_gettime(CLOCK_REALTIME, &snap->when);
+	snap->bus_us = bus_us;
+	snap->retries = retries;
+	int good = 0;
+	for (unsigned int v = snap->valid; v; v &= v - 1) good++;
+	return good;
+}
@@ -0,0 +1,163 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// libsbs - Smart Battery register table and poll plan, built on the
+// SMBus transport in smbus.c. See sbs.c.
+//
+// Every word register is one line in SBS_WORD_REGISTERS. The snapshot
+// fields, the SBS_ flags, the decoders, the plausibility checks and the
+// pretty-printer are all generated from it by the compiler, so adding a
+// register is one line here and costs nothing at run time.
+//
+#ifndef SBS_H
+#define SBS_H
+
+#include <stdio.h>
+#include <time.h>
+#include "smbus.h"
+
+// Register flags
+#define SBS_ONES_OK 1 // 0xffff is a real value, not just nobody driving data
+#define SBS_HIDE 2 // don't print values outside min/max (ie FFFF minutes)
+#define SBS_FOREVER -1 // cache age for registers that only change with the pack
+#define sbs_block_tries 2 // tries for each block register read
+
+// Word registers in the order they are read. Battery status has to be
+// first, if it can't be read the rest of a poll is skipped.
+// Columns: flag name, snapshot field, register pointer, C type of the
+// raw value, divide by, then add (to get display units), plausible raw
+// min and max for batteries without PEC, flags, how many seconds
+// sbs_cached() keeps the value (0 = read every time, SBS_FOREVER = until
+// the pack is swapped), how many times to try a read before giving up,
+// label, printf format and units for the printer.
+#define SBS_WORD_REGISTERS(X) \
+	X(STATUS,          status,          0x16, unsigned short, 1,    0,       0,     0xffff, 0,                      0,           2, "Battery Status",       "%#06x", "Hex") \
+	X(VOLTAGE,         voltage,         0x09, unsigned short, 1000, 0,       6001,  21999,  0,                      0,           3, "Voltage",              "%6.3f", "Volts") \
+	X(CURRENT,         current,         0x0a, short,          1,    0,       -2999, 2999,   0,                      0,           3, "Current",              "%.0f",  "mA") \
+	X(AVERAGE_CURRENT, average_current, 0x0b, short,          1,    0,       -2999, 2999,   0,                      0,           2, "Average Current",      "%.0f",  "mA") \
+	X(TEMPERATURE,     temperature,     0x08, unsigned short, 10,   -273.15, 0,     3131,   0,                      0,           3, "Temperature",          "%5.2f", "degrees C") \
+	X(SOC,             soc,             0x0d, unsigned short, 1,    0,       0,     149,    0,                      0,           3, "State of Charge",      "%.0f",  "percent") \
+	X(REMAINING_CAP,   remaining_cap,   0x0f, unsigned short, 1,    0,       0,     32767,  0,                      0,           2, "Remaining Capacity",   "%.0f",  "mAh") \
+	X(TIME_TO_EMPTY,   time_to_empty,   0x12, unsigned short, 1,    0,       0,     1000,   SBS_ONES_OK | SBS_HIDE, 0,           2, "Time to empty",        "%.0f",  "minutes") \
+	X(TIME_TO_FULL,    time_to_full,    0x13, unsigned short, 1,    0,       1,     1000,   SBS_ONES_OK | SBS_HIDE, 0,           2, "Time to full",         "%.0f",  "minutes") \
+	X(FULL_CAPACITY,   full_capacity,   0x10, unsigned short, 1,    0,       100,   32767,  0,                      600,         2, "Full Charge Capacity", "%.0f",  "mAh") \
+	X(DESIGN_CAPACITY, design_capacity, 0x18, unsigned short, 1,    0,       100,   32767,  0,                      SBS_FOREVER, 2, "Design Capacity",      "%.0f",  "mAh") \
+	X(SERIAL_NUMBER,   serial_number,   0x1c, unsigned short, 1,    0,       0,     0xfffe, 0,                      60,          2, "Serial Number",        "%.0f",  "")
+
+// Block (string) registers, read with one SMBus Block Read each.
+// These never change while the pack is in, sbs_cached() keeps them forever.
+// They get sbs_block_tries tries.
+#define SBS_BLOCK_REGISTERS(X) \
+	X(MANUFACTURER, manufacturer, 0x20, "Manufacturer") \
+	X(DEVICE_NAME,  device_name,  0x21, "Device Name")
+
+// BatteryStatus bits shown by sbs_print()
+#define SBS_STATUS_BITS(X) \
+	X(0x8000, "OVERCHARGE ALARM") \
+	X(0x4000, "TERMINATE CHARGE ALARM") \
+	X(0x1000, "OVER TEMP ALARM") \
+	X(0x0800, "TERMINATE DISCHARGE ALARM") \
+	X(0x0200, "REMAINING CAPACITY ALARM") \
+	X(0x0100, "REMAINING TIME ALARM") \
+	X(0x0080, "Initialized") \
+	X(0x0040, "Discharging") \
+	X(0x0020, "Fully Charged") \
+	X(0x0010, "Fully Discharged")
+#define SBS_STATUS_UNKNOWN 0x240f // bits with no meaning in the SBS spec
+
+// Register numbers, ie SBS_REG_VOLTAGE = 0x09
+#define SBS_REG(NAME, field, reg, ...) SBS_REG_##NAME = reg,
+#define SBS_BLOCK_REG(NAME, field, reg, label) SBS_REG_##NAME = reg,
+enum { SBS_WORD_REGISTERS(SBS_REG) SBS_BLOCK_REGISTERS(SBS_BLOCK_REG) };
+#undef SBS_REG
+#undef SBS_BLOCK_REG
+
+// Position of each register in the tables, then a flag for each one
+// to build poll plans and valid masks with, ie SBS_VOLTAGE
+#define SBS_INDEX(NAME, ...) SBS_INDEX_##NAME,
+enum { SBS_WORD_REGISTERS(SBS_INDEX) SBS_BLOCK_REGISTERS(SBS_INDEX) SBS_REGISTER_COUNT };
+#undef SBS_INDEX
+#define SBS_FLAG(NAME, ...) SBS_##NAME = 1 << SBS_INDEX_##NAME,
+enum { SBS_WORD_REGISTERS(SBS_FLAG) SBS_BLOCK_REGISTERS(SBS_FLAG) };
+#undef SBS_FLAG
+#define SBS_WORD_FLAG(NAME, ...) | SBS_##NAME
+#define SBS_ALL_WORDS (0 SBS_WORD_REGISTERS(SBS_WORD_FLAG)) // every word register
+#define SBS_ALL_BLOCKS (SBS_MANUFACTURER | SBS_DEVICE_NAME)
+#define SBS_READ_BATTERY (SBS_STATUS | SBS_VOLTAGE | SBS_CURRENT | SBS_TEMPERATURE | SBS_SOC | \
+	SBS_TIME_TO_EMPTY | SBS_TIME_TO_FULL) // the seven registers read_battery has always shown
+#define SBS_PRINT_UNKNOWN (1u << 31) // sbs_print() option, say "Unknown" when status bits with no meaning are set
+
+// One poll of the battery
+#define SBS_WORD_FIELD(NAME, field, reg, type, ...) type field;
+#define SBS_BLOCK_FIELD(NAME, field, reg, label) char field[33]; // up to 32 characters
+struct sbs_snapshot {
+	unsigned int valid; // SBS_ flag set for each field that was read OK
+	struct timespec when; // wall clock time the poll started
+	unsigned int bus_us; // how long the whole poll took in usec
+	unsigned int retries; // reads after the first one of a register it took
+	SBS_WORD_REGISTERS(SBS_WORD_FIELD) // raw register values
+	SBS_BLOCK_REGISTERS(SBS_BLOCK_FIELD)
+};
+#undef SBS_WORD_FIELD
+#undef SBS_BLOCK_FIELD
+
+// Decoders, raw value to display units, ie sbs_voltage(snap) in Volts
+#define SBS_DECODER(NAME, field, reg, type, scale, offset, ...) \
+static inline double sbs_##field(const struct sbs_snapshot *snap) \
+{ \
+	return (double)snap->field / scale + offset; \
+}
+SBS_WORD_REGISTERS(SBS_DECODER)
+#undef SBS_DECODER
+
+// Plausibility checks on a raw value, ie sbs_plausible_voltage(raw)
+#define SBS_CHECK(NAME, field, reg, type, scale, offset, min, max, flags, ...) \
+static inline _Bool sbs_plausible_##field(unsigned short raw) \
+{ \
+	int value = (type)raw; /* sign extends the signed registers */ \
+	if (raw == 0xffff) return ((flags) & SBS_ONES_OK) != 0; \
+	return (value >= (min)) & (value <= (max)); \
+}
+SBS_WORD_REGISTERS(SBS_CHECK)
+#undef SBS_CHECK
+
+int sbs_poll(unsigned int plan, struct sbs_snapshot *snap); // returns # of fields read OK
+
+// Why a read was no good. The SMBUS_ codes from smbus.h, plus these two
+// for batteries without PEC, where a bad read can only be guessed at.
+enum {
+	SBS_ALL_ONES = SMBUS_ERRORS, // read back FFFF, nobody was driving data
+	SBS_OUT_OF_RANGE, // outside the register's plausibility window
+	SBS_ERRORS // number of codes
+};
+// Running counters for each register, indexed by SBS_INDEX_
+struct sbs_stats {
+	unsigned int reads; // transactions, retries included
+	unsigned int retries; // reads after the first one of a poll
+	unsigned int failed; // polls where every try was bad
+	unsigned int why[SBS_ERRORS]; // bad reads by cause
+};
+extern __thread struct sbs_stats sbs_stats[SBS_REGISTER_COUNT]; // the calling thread's
+void sbs_retry(unsigned int regs, int tries); // change the table's tries at run time
+void sbs_print_stats(FILE *out); // reads, retries and failures per register
+const char *sbs_error_name(int why); // SMBUS_ or SBS_ error code as text
+
+// Register cache. sbs_cached() answers from memory for registers that
+// are younger than their max age and only goes to the bus for the rest.
+extern __thread unsigned int sbs_pack; // goes up by one each time a new battery pack is seen (this thread's)
+int sbs_cached(unsigned int plan, struct sbs_snapshot *snap); // returns # of fields valid
+void sbs_max_age(unsigned int regs, int seconds); // change the table's max age at run time
+void sbs_invalidate(void); // forget everything, ie after writing to the battery
+void sbs_print(FILE *out, const struct sbs_snapshot *snap, unsigned int plan); // read_battery style text, registers in the plan
+
+#endif
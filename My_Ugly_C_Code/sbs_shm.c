@@ -0,0 +1,120 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Shared battery snapshot. Every program that wants to know about the
+// battery used to bit-bang GPIO 2/3 itself, at top priority, and could
+// run into monitor_battery in the middle of a transaction. Now
+// monitor_battery publishes each snapshot it reads into a small POSIX
+// shared memory segment and other programs (read_battery --cached, a
+// fuel gauge display) copy it from there without touching the bus and
+// without needing root.
+//
+// The segment is guarded by a sequence lock. The writer makes the
+// sequence number odd, copies the snapshot in, then makes it even
+// again. A reader copies the snapshot out between two reads of the
+// sequence number and tries again if they differ or are odd, so it
+// never sees half of an update and never holds up the monitor. There is
+// only one writer so it needs no lock of its own.
+//
+// The segment also holds the size of struct sbs_snapshot so a program
+// built with a different register table in sbs.h doesn't misread it.
+//
+// Programs using it need sbs_shm.c and -l rt on older Raspbian:
+//     gcc -o read_battery read_battery.c sbs.c smbus.c telemetry.c sbs_shm.c -l wiringPi -l pthread -l rt
+//
+// Rev 1.0 - Feb 2021 - Original release
+//
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "sbs.h"
+#include "sbs_shm.h"
+
+#define shm_magic 0x53425331 // "SBS1"
+#define read_tries 1000 // give up if the writer looks stuck half way (it died)
+
+struct shared {
+	unsigned int magic;
+	unsigned int size; // sizeof(struct sbs_snapshot) of the writer
+	atomic_uint seq; // odd while the snapshot is being written
+	struct sbs_snapshot snap;
+};
+
+static struct shared *seg = NULL; // writer's mapping
+
+// Functions
+int sbs_publish_open(void)
+{
+	int fd = shm_open(sbs_shm_name, O_RDWR | O_CREAT, 0644); // anyone can read it
+	if (fd < 0)
+	{
+		perror(sbs_shm_name);
+		return -1;
+	}
+	if (ftruncate(fd, sizeof(struct shared)))
+	{
+		perror(sbs_shm_name);
+		close(fd);
+		return -1;
+	}
+	void *map = mmap(NULL, sizeof(struct shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd); // the mapping stays valid
+	if (map == MAP_FAILED)
+	{
+		perror("mmap");
+		return -1;
+	}
+	seg = map;
+	atomic_store(&seg->seq, 0); // nothing published yet, a dead writer may have left it odd
+	seg->magic = shm_magic;
+	seg->size = sizeof(struct sbs_snapshot);
+	memset(&seg->snap, 0, sizeof(seg->snap)); // valid = 0 until the first poll
+	return 0;
+}
+//
+void sbs_publish(const struct sbs_snapshot *snap)
+{
+	if (!seg) return;
+	unsigned int seq = atomic_load_explicit(&seg->seq, memory_order_relaxed);
+	atomic_store_explicit(&seg->seq, seq + 1, memory_order_relaxed); // odd, readers wait
+	atomic_thread_fence(memory_order_release); // the odd number is seen before any of the new data
+	memcpy(&seg->snap, snap, sizeof(*snap));
+	atomic_store_explicit(&seg->seq, seq + 2, memory_order_release); // even, all the new data is seen first
+}
+//
+int sbs_shared(struct sbs_snapshot *snap)
+{
+	static struct shared *view = NULL; // reader's mapping, kept for the next call
+	if (!view) {
+	  int fd = shm_open(sbs_shm_name, O_RDONLY, 0);
+	  if (fd < 0) return -1; // monitor_battery hasn't run since boot
+	  void *map = mmap(NULL, sizeof(struct shared), PROT_READ, MAP_SHARED, fd, 0);
+	  close(fd);
+	  if (map == MAP_FAILED) return -1;
+	  view = map;
+	}
+	if ((view->magic != shm_magic) || (view->size != sizeof(struct sbs_snapshot))) return -1;
+	for (int i=0; i<read_tries; i++) {
+	  unsigned int before = atomic_load_explicit(&view->seq, memory_order_acquire);
+	  if (before & 1) continue; // being written
+	  memcpy(snap, &view->snap, sizeof(*snap));
+	  atomic_thread_fence(memory_order_acquire); // the copy is done before seq is read again
+	  if (atomic_load_explicit(&view->seq, memory_order_relaxed) == before) {
+		return (before == 0) ? -1 : 0; // 0 = opened but nothing published yet
+	  }
+	}
+	return -1;
+}
@@ -0,0 +1,28 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Latest battery snapshot shared by monitor_battery with any program on
+// the Pi, through POSIX shared memory. See sbs_shm.c.
+//
+#ifndef SBS_SHM_H
+#define SBS_SHM_H
+
+#include "sbs.h"
+
+#define sbs_shm_name "/sbs_battery" // shows up as /dev/shm/sbs_battery
+
+int sbs_publish_open(void); // make the segment, monitor_battery only. 0 = OK
+void sbs_publish(const struct sbs_snapshot *snap); // no-op if the segment isn't open
+int sbs_shared(struct sbs_snapshot *snap); // copy of the latest snapshot. 0 = OK, -1 = no publisher
+
+#endif
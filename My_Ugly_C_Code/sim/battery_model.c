@@ -0,0 +1,176 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Simulated 3 cell pack and its gauge, behind sbs_slave.c. Battery time
+// is sim time times SIM_SPEED, and the pack is brought up to date in 1
+// second steps each time a register is read.
+//
+// Discharging, the Pi draws SIM_LOAD mA plus SIM_SPIKE mA for 20 seconds
+// out of every 2 minutes. With SIM_CHARGER=1 the pack charges at 1500 mA
+// (tapering above 90%) once it has seen the Dell enable write (0x000A to
+// register 0x00), unless monitor_battery is holding the charger off on
+// GPIO 19. Voltage follows a Li-ion open circuit curve less 50 mOhm per
+// cell times the current, and the cells warm up with the current.
+//
+// The gauge's RemainingCapacity is off by SIM_DRIFT mAh per hour of
+// battery time, so the coulomb counter has something to find.
+//
+// With the charger plugged in, a smart charger answers at 0x09 with its
+// spec info, status (AC present, battery present, inhibited while it is
+// held off) and the charging current and voltage it is putting out.
+//
+// Rev 1.0 - Feb 2021 - Original release
+// Rev 1.1 - Feb 2021 - Smart charger registers
+// Rev 1.2 - Mar 2021 - Pack swap
+//
+#include <math.h>
+#include <string.h>
+#include "sim.h"
+
+#define cells 3
+#define cell_ohms 0.05
+#define design_mah 4400
+#define charge_ma 1500
+#define charger_off_pin 19 // monitor_battery drives this high to stop the charger
+#define charge_mv 12600 // 4.2 V a cell
+#define spike_period 120 // seconds
+#define spike_time 20
+#define average_time 60 // seconds, AverageCurrent time constant
+#define heat_time 300 // seconds, how fast the cells warm up
+#define step 1.0 // seconds per model step
+
+static double full, charge, load, spike, drift, speed; // mAh, mAh, mA, mA, mAh per hour, x
+static _Bool charger;
+static _Bool dell_enabled = 0; // enable write seen
+static double t = 0; // battery seconds so far
+static double current, average, kelvin = 298.15, gauge_error = 0;
+static unsigned short serial = 1234;
+
+// Open circuit voltage of one cell by SoC, every 10%
+static const double ocv[11] = {3.00, 3.55, 3.64, 3.69, 3.73, 3.78, 3.84, 3.91, 3.99, 4.08, 4.20};
+
+// Functions
+static double draw(void) // current into the pack right now, mA
+{
+	if (charger && dell_enabled && (sim_pin(charger_off_pin) != 2)) { // charger isn't being held off
+	  if (charge >= full) return 0;
+	  double soc = charge / full;
+	  return (soc > 0.9) ? charge_ma * (1 - soc) * 10 : charge_ma; // taper at the top
+	}
+	if (charger) return 0; // plugged in, running the Pi, not charging
+	if (charge <= 0) return 0; // pack protection has cut it off
+	return -(load + ((fmod(t, spike_period) < spike_time) ? spike : 0));
+}
+//
+void battery_setup(void)
+{
+	full = sim_setting("SIM_FULL", 4000);
+	charge = full * sim_setting("SIM_SOC", 80) / 100;
+	load = sim_setting("SIM_LOAD", 900);
+	spike = sim_setting("SIM_SPIKE", 1500);
+	charger = sim_setting("SIM_CHARGER", 0) != 0;
+	drift = sim_setting("SIM_DRIFT", 0);
+	speed = sim_setting("SIM_SPEED", 1);
+	current = average = draw(); // so the first reads aren't all 0 mA
+}
+//
+static void catch_up(void) // run the pack up to now
+{
+	double now = sim_now() / 1e6 * speed;
+	if (now - t > 86400) t = now - 86400; // no more than a day at a time
+	while (t + step <= now) {
+	  current = draw();
+	  charge += current * step / 3600;
+	  if (charge > full) charge = full;
+	  if (charge < 0) charge = 0;
+	  average += (current - average) * step / average_time;
+	  kelvin += (298.15 + fabs(current) / 1000 * 4 - kelvin) * step / heat_time;
+	  gauge_error += drift * step / 3600;
+	  t += step;
+	}
+}
+//
+static double volts(void)
+{
+	double soc = charge / full * 10;
+	int i = (soc >= 10) ? 9 : (int)soc;
+	double cell = ocv[i] + (ocv[i + 1] - ocv[i]) * (soc - i);
+	return cells * (cell + current / 1000 * cell_ohms);
+}
+//
+int battery_word(unsigned char reg, unsigned short *value)
+{
+	catch_up();
+	int soc = (int)(charge * 100 / full);
+	double remaining = charge + gauge_error;
+	if (remaining < 0) remaining = 0;
+	switch (reg) {
+	  case 0x00: *value = 0; break; // ManufacturerAccess
+	  case 0x08: *value = (unsigned short)(kelvin * 10); break; // 0.1 K
+	  case 0x09: *value = (unsigned short)(volts() * 1000); break; // mV
+	  case 0x0a: *value = (unsigned short)(short)current; break; // mA
+	  case 0x0b: *value = (unsigned short)(short)average; break;
+	  case 0x0d: *value = soc; break; // RelativeStateOfCharge
+	  case 0x0f: *value = (unsigned short)remaining; break; // mAh
+	  case 0x10: *value = (unsigned short)full; break;
+	  case 0x12: *value = (current < 0) ? (unsigned short)(charge / -current * 60) : 0xffff; break; // minutes
+	  case 0x13: *value = (current > 0) ? (unsigned short)((full - charge) / current * 60) : 0xffff; break;
+	  case 0x16: // BatteryStatus
+		*value = 0x0080; // initialized
+		if (current <= 0) *value |= 0x0040; // discharging
+		if (soc >= 100) *value |= 0x0020; // fully charged
+		if (charge <= 0) *value |= 0x0010 | 0x0800; // fully discharged, terminate discharge
+		if (soc < 10) *value |= 0x0200; // remaining capacity alarm
+		if (kelvin > 273.15 + 60) *value |= 0x1000; // over temperature
+		break;
+	  case 0x18: *value = design_mah; break;
+	  case 0x1c: *value = serial; break;
+	  default: return 0;
+	}
+	return 1;
+}
+//
+int battery_block(unsigned char reg, unsigned char *buf)
+{
+	const char *text;
+	if (reg == 0x20) text = "SIM"; // ManufacturerName
+	else if (reg == 0x21) text = "DELL 0SIM0"; // DeviceName
+	else return 0;
+	memcpy(buf, text, strlen(text));
+	return strlen(text);
+}
+//
+void battery_write(unsigned char reg, unsigned short value)
+{
+	if ((reg == 0x00) && (value == 0x000a)) dell_enabled = 1; // the D630 charge enable
+}
+//
+void battery_swap(void)
+{
+	serial++; // a different pack
+	dell_enabled = 0; // that has to be enabled for charging again
+}
+//
+int charger_word(unsigned char reg, unsigned short *value)
+{
+	catch_up();
+	_Bool held_off = (sim_pin(charger_off_pin) == 2) || !dell_enabled;
+	switch (reg) {
+	  case 0x11: *value = 0x0001; break; // ChargerSpecInfo, version 1.0
+	  case 0x13: *value = 0xc000 | (held_off ? 0x0001 : 0); break; // ChargerStatus, AC and battery present, inhibited
+	  case 0x14: *value = (current > 0) ? (unsigned short)current : 0; break; // ChargingCurrent, mA
+	  case 0x15: *value = held_off ? 0 : charge_mv; break; // ChargingVoltage, mV
+	  default: return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,251 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Battery simulator, so the SMBus code can be worked on with no Pi and
+// no battery. The programs are built unchanged against this directory
+// instead of wiringPi and a simulated smart battery answers on GPIO 2/3:
+//
+// - fake_gpio.c (this file) stands in for wiringPi. It keeps a sim clock
+//   in usec that delayMicroseconds() and delay() move forward without
+//   sleeping, so bus transactions run as fast as the PC can go. When the
+//   program really sleeps (epoll_wait in monitor_battery) the sim clock
+//   catches up with the real one.
+// - sbs_slave.c is the battery's SMBus interface, run edge by edge off
+//   the same pins: start, stop, address and register ACK/NACK, clock
+//   stretching, PEC and the SMBus 25 msec timeout, with bit errors that
+//   can be turned on.
+// - battery_model.c is a 3 cell pack with a load that comes and goes,
+//   a charger, voltage sag, heating and a gauge that can drift.
+//
+// Build any of the programs with -I sim and the three sim files in place
+// of -l wiringPi, plus -l m (battery_model.c uses fmod()). char is
+// unsigned on the Pi and the bus code counts on it (send8's mask), so
+// x86 needs -funsigned-char, ie:
+//     gcc -funsigned-char -I sim -o sim_read_battery read_battery.c sbs.c smbus.c telemetry.c sbs_shm.c sim/fake_gpio.c sim/sbs_slave.c sim/battery_model.c -l pthread -l rt -l m
+//     gcc -funsigned-char -I sim -o sim_read_battery_loop read_battery_loop.c sbs.c smbus.c telemetry.c sbs_shm.c sim/fake_gpio.c sim/sbs_slave.c sim/battery_model.c -l pthread -l rt -l m
+//     gcc -funsigned-char -I sim -o sim_monitor monitor_battery.c sbs.c smbus.c telemetry.c sbs_shm.c metrics.c predict.c coulomb.c sim/fake_gpio.c sim/sbs_slave.c sim/battery_model.c -l pthread -l rt -l m
+//     gcc -funsigned-char -I sim -o sim_poll_devices poll_devices.c sbs.c smbus.c sim/fake_gpio.c sim/sbs_slave.c sim/battery_model.c -l pthread -l m
+//     gcc -funsigned-char -I sim -o sim_smbus_broker smbus_broker.c smbus.c sim/fake_gpio.c sim/sbs_slave.c sim/battery_model.c -l pthread -l m
+//     gcc -funsigned-char -I sim -o sim_bench_smbus bench_smbus.c sbs.c smbus.c sim/fake_gpio.c sim/sbs_slave.c sim/battery_model.c -l pthread -l m
+// and run them with -g, or with -d /dev/gpiomem for the register bit-bang
+// in smbus.c. That gets a fake GPIO register file (GPFSEL, GPCLR and
+// GPLEV) on the same pins as the wiringPi calls, so both go through the
+// same battery.
+// dump_telemetry doesn't touch the bus and needs no sim files:
+//     gcc -o dump_telemetry dump_telemetry.c telemetry.c
+//
+// Settings come from the environment, ie SIM_BITERR=1e-4 ./sim_read_battery -g
+//     SIM_SEED      random seed (1)
+//     SIM_JITTER    chance a bus delay gets preempted (0)
+//     SIM_PREEMPT   usec a preempted delay runs late (200)
+//     SIM_STRETCH   usec the battery holds the clock after each byte (0)
+//     SIM_HANG      chance the battery holds it past the 35 msec timeout instead (0)
+//     SIM_BITERR    chance each bit the battery sends or gets is flipped (0)
+//     SIM_NACK      chance the battery NACKs its address (0)
+//     SIM_PEC       1 = battery sends and checks PEC bytes (1)
+//     SIM_VERBOSE   1 = print every transaction (0)
+//     SIM_SPEED     battery time runs this many times faster than sim time (1)
+//     SIM_SOC       starting state of charge, percent (80)
+//     SIM_FULL      full charge capacity, mAh (4000)
+//     SIM_LOAD      Pi's current draw, mA (900)
+//     SIM_SPIKE     extra draw for 20 seconds out of every 2 minutes, mA (1500)
+//     SIM_CHARGER   1 = charger plugged in, and a smart charger at 0x09 (0)
+//     SIM_DRIFT     gauge RemainingCapacity error growing at mAh per hour (0)
+//     SIM_SWAP      seconds until the pack is swapped for one with the other SIM_PEC (0)
+//
+// Pack swap test. A PEC pack swapped for one without is only found if
+// sbs_cached() gets PEC off again, so run read_battery_loop with
+//     SIM_SWAP=20 ./sim_read_battery_loop -g
+// It should show Serial Number = 1234 for the first two loops and 1235
+// from the third on, with no "did not respond" in between. SIM_PEC=0
+// does it the other way round. The new pack answers fine without PEC
+// and is found when its serial number is due, after a minute of real
+// time (the cache ages go by the real clock, not the sim one).
+//
+// Rev 1.0 - Feb 2021 - Original release
+// Rev 1.1 - Mar 2021 - Pack swap test
+// Rev 1.2 - Mar 2021 - GPIO register file for the /dev/gpiomem transport
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "wiringPi.h"
+#include "sim.h"
+
+#define clock 3 // SMBus clock, GPIO3
+#define data 2 // SMBus data, GPIO2
+#define pins 54
+#define read_us 1 // sim time a digitalRead() takes, so wait loops move the clock
+#define GPFSEL0 0 // BCM283x GPIO register word offsets, the same as smbus.c
+#define GPCLR0 10
+#define GPLEV0 13
+#define gpio_words 1024 // the 4 KB block smbus.c would map
+
+static unsigned long long sim_us = 0; // sim clock
+static struct timespec start; // real time the program started
+static int mode[pins]; // INPUT or OUTPUT
+static int latch[pins]; // level written
+static unsigned long long seed = 1;
+static double jitter, preempt;
+static volatile unsigned int gpio_mem[gpio_words]; // register file, GPFSEL kept in step with mode[]
+
+// Functions
+double sim_setting(const char *name, double value)
+{
+	const char *text = getenv(name);
+	return text ? atof(text) : value;
+}
+//
+double sim_random(void) // xorshift, the same every run with the same SIM_SEED
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return (seed >> 11) * (1.0 / 9007199254740992.0);
+}
+//
+unsigned long long sim_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	unsigned long long real = (now.tv_sec - start.tv_sec) * 1000000ULL + (now.tv_nsec - start.tv_nsec) / 1000;
+	if (real > sim_us) sim_us = real; // the program slept for real
+	return sim_us;
+}
+//
+int sim_pin(int pin)
+{
+	if ((pin < 0) || (pin >= pins) || (mode[pin] != OUTPUT)) return 1;
+	return (latch[pin] == LOW) ? 0 : 2;
+}
+//
+static void lines(int *scl, int *sda) // what the bus pins are at, after the battery has its say
+{
+	slave_lines(sim_pin(clock) != 0, sim_pin(data) != 0, scl, sda);
+}
+//
+int wiringPiSetupGpio(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i=0; i<pins; i++) latch[i] = HIGH; // everything floats, pulled up
+	seed = (unsigned long long)sim_setting("SIM_SEED", 1);
+	if (seed == 0) seed = 1; // xorshift sticks at 0
+	jitter = sim_setting("SIM_JITTER", 0);
+	preempt = sim_setting("SIM_PREEMPT", 200);
+	battery_setup();
+	slave_setup();
+	return 0;
+}
+//
+int piHiPri(int pri)
+{
+	(void)pri;
+	return 0;
+}
+//
+void pinMode(int pin, int m)
+{
+	if ((pin < 0) || (pin >= pins)) return;
+	mode[pin] = m;
+	unsigned int shift = (pin % 10) * 3; // as wiringPi would, in the function select bits
+	gpio_mem[GPFSEL0 + pin / 10] = (gpio_mem[GPFSEL0 + pin / 10] & ~(7u << shift)) | ((m == OUTPUT) ? 1u << shift : 0);
+	int scl, sda;
+	if ((pin == clock) || (pin == data)) lines(&scl, &sda); // the battery sees the edge
+}
+//
+void digitalWrite(int pin, int value)
+{
+	if ((pin < 0) || (pin >= pins)) return;
+	latch[pin] = value;
+	int scl, sda;
+	if ((pin == clock) || (pin == data)) lines(&scl, &sda);
+}
+//
+int digitalRead(int pin)
+{
+	sim_now();
+	sim_us += read_us;
+	if ((pin == clock) || (pin == data)) {
+	  int scl, sda;
+	  lines(&scl, &sda);
+	  return (pin == clock) ? scl : sda;
+	}
+	if (pin == 22) return 1; // LCD status, the LCD is on
+	return sim_pin(pin) != 0;
+}
+//
+void delayMicroseconds(unsigned int us)
+{
+	sim_now();
+	sim_us += us;
+	if ((jitter > 0) && (sim_random() < jitter)) sim_us += preempt; // Linux ran something else
+}
+//
+void delay(unsigned int ms)
+{
+	sim_now();
+	sim_us += ms * 1000ULL;
+}
+//
+unsigned int micros(void)
+{
+	return (unsigned int)sim_now();
+}
+//
+unsigned int millis(void)
+{
+	return (unsigned int)(sim_now() / 1000);
+}
+//
+volatile unsigned int *sim_gpiomem(void)
+{
+	return gpio_mem;
+}
+//
+void sim_gpio_sync(int word, int wrote) // the pins follow the registers
+{
+	int scl, sda;
+	if (wrote && (word >= GPFSEL0) && (word < GPFSEL0 + 6)) { // function select, 001 = output
+	  for (int pin=(word - GPFSEL0) * 10; (pin < (word - GPFSEL0 + 1) * 10) && (pin < pins); pin++) {
+		mode[pin] = (((gpio_mem[word] >> ((pin % 10) * 3)) & 7) == 1) ? OUTPUT : INPUT;
+	  }
+	  lines(&scl, &sda); // the battery sees any edge
+	}
+	else if (wrote && ((word == GPCLR0) || (word == GPCLR0 + 1))) { // each 1 bit drives its latch low
+	  for (int bit=0; bit<32; bit++) {
+		int pin = (word - GPCLR0) * 32 + bit;
+		if ((pin < pins) && (gpio_mem[word] & (1u << bit))) latch[pin] = LOW;
+	  }
+	  gpio_mem[word] = 0; // write only
+	  lines(&scl, &sda);
+	}
+	else if (!wrote && ((word == GPLEV0) || (word == GPLEV0 + 1))) { // levels as they are now
+	  sim_now();
+	  sim_us += read_us;
+	  lines(&scl, &sda);
+	  unsigned int levels = 0;
+	  for (int bit=0; bit<32; bit++) {
+		int pin = (word - GPLEV0) * 32 + bit;
+		if (pin >= pins) break;
+		int level = (pin == clock) ? scl : (pin == data) ? sda : (sim_pin(pin) != 0);
+		if (level) levels |= 1u << bit;
+	  }
+	  gpio_mem[word] = levels;
+	}
+}
+//
+int system(const char *command) // monitor_battery's shutdown, not on this PC
+{
+	fprintf(stderr, "sim: not running \"%s\"\n", command);
+	return 0;
+}
@@ -0,0 +1,278 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Simulated battery SMBus interface, address 0x0b, and with SIM_CHARGER=1
+// a smart charger at 0x09 on the same bus. fake_gpio.c calls
+// slave_lines() every time the Pi changes or reads GPIO 2/3, with what
+// the Pi is doing to each line. The lines are low if either side pulls
+// them low. Any edge since the last call moves the slave along:
+//
+// - data falling while the clock is high is a start, rising is a stop
+// - while receiving, data is sampled on each rising clock edge and the
+//   ACK or NACK goes out on the 8th falling edge
+// - while sending, the next bit goes out on each falling edge and the
+//   Pi's ACK is sampled on the 9th rising edge
+//
+// The battery ACKs its address (unless SIM_NACK says otherwise) and any
+// register battery_model.c knows about, and NACKs the rest. The charger
+// is the same, with charger_word() for its registers. Reads send
+// the word or block, then the PEC byte if the Pi ACKs for more, then
+// FFFF. A write's PEC byte is checked and NACKed if wrong, and the write
+// only happens at the stop if nothing was NACKed.
+//
+// After ACKing a byte the battery holds the clock low for SIM_STRETCH
+// usec, or past the Pi's 35 msec stretch timeout with a chance of
+// SIM_HANG. If the Pi holds the clock low for more than 25 msec the
+// battery gives up on the transaction, like a real SMBus device.
+// SIM_BITERR flips bits in both directions.
+//
+// SIM_SWAP swaps the pack that many seconds into the run for one with
+// the other PEC setting and a new serial number, ie a PEC pack for one
+// without, to check the program finds the new pack and its PEC setting.
+//
+// Rev 1.0 - Feb 2021 - Original release
+// Rev 1.1 - Feb 2021 - Smart charger at 0x09
+// Rev 1.2 - Mar 2021 - Pack swap (SIM_SWAP)
+//
+#include <stdio.h>
+#include "sim.h"
+
+#define address 0x0b
+#define charger 0x09
+#define smbus_timeout 25000 // usec of clock low before the battery resets its interface
+#define hang_us 40000 // a stretch longer than the Pi waits
+#define max_bytes 40 // longest transaction, block read with PEC and a few extra
+
+enum {idle, receive, receive_ack, send, send_ack, wait_stop}; // what the slave is doing
+static int state = idle;
+static int scl = 1, sda = 1; // line levels after the last call
+static _Bool pull_data = 0; // the battery is pulling data low
+static unsigned long long hold_until = 0; // the battery holds the clock low until then
+static unsigned long long clock_fell; // when the clock last went low
+static unsigned char shift; // byte coming in or going out
+static int bits; // bits of it done
+static _Bool expect_address; // next byte in is an address
+static _Bool reading; // the address had the read bit
+static _Bool acked; // ACK for the byte just received
+static _Bool master_ack; // the Pi's ACK for the byte just sent
+static _Bool nacked; // something in this transaction was NACKed
+static int device; // address of the transaction, battery or charger
+static int command; // register, -1 = not sent yet
+static unsigned char msg[max_bytes]; // bytes received, for the PEC
+static int msg_len;
+static unsigned char out[max_bytes]; // bytes to send
+static int out_len, out_pos;
+static double stretch, hang, biterr, nack_chance;
+static unsigned long long swap_at; // sim usec the pack gets swapped, 0 = never
+static _Bool pec, verbose, charger_on;
+
+// Functions
+static unsigned char crc8(unsigned char crc, const unsigned char *buf, int len) // bit at a time, not the table in smbus.c
+{
+	while (len--) {
+	  crc ^= *buf++;
+	  for (int i=0; i<8; i++) crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+	}
+	return crc;
+}
+//
+void slave_setup(void)
+{
+	stretch = sim_setting("SIM_STRETCH", 0);
+	hang = sim_setting("SIM_HANG", 0);
+	biterr = sim_setting("SIM_BITERR", 0);
+	nack_chance = sim_setting("SIM_NACK", 0);
+	pec = sim_setting("SIM_PEC", 1) != 0;
+	verbose = sim_setting("SIM_VERBOSE", 0) != 0;
+	charger_on = sim_setting("SIM_CHARGER", 0) != 0;
+	swap_at = sim_setting("SIM_SWAP", 0) * 1000000;
+}
+//
+static int word(unsigned short *value) // the register of whichever device was addressed
+{
+	if (device == charger) return charger_word(command, value);
+	return battery_word(command, value);
+}
+//
+static int block(unsigned char *buf)
+{
+	if (device == charger) return 0; // no block registers
+	return battery_block(command, buf);
+}
+//
+static int flip(int bit) // bit error injection
+{
+	return ((biterr > 0) && (sim_random() < biterr)) ? !bit : bit;
+}
+//
+static void start(void)
+{
+	if (!((state == receive) && (command >= 0) && (msg_len == 2))) { // not a repeated start for a read
+	  msg_len = 0;
+	  command = -1;
+	  nacked = 0;
+	}
+	state = receive;
+	shift = 0;
+	bits = 0;
+	expect_address = 1;
+	pull_data = 0;
+}
+//
+static void stop(void)
+{
+	if (verbose) {
+	  fprintf(stderr, "sim: %s", nacked ? "NACKed" : "");
+	  for (int i=0; i<msg_len; i++) fprintf(stderr, " %02x", msg[i]);
+	  if (reading) {
+		fprintf(stderr, " ->");
+		for (int i=0; i<out_pos; i++) fprintf(stderr, " %02x", out[i]);
+	  }
+	  fprintf(stderr, "\n");
+	}
+	if (!nacked && !reading && (command >= 0) && (msg_len >= 4) && (device == address)) { // complete battery write word
+	  battery_write(command, msg[2] | (msg[3] << 8));
+	}
+	state = idle;
+	pull_data = 0;
+	hold_until = 0;
+}
+//
+static void byte_in(unsigned long long now) // 8 bits are in, work out the ACK
+{
+	unsigned char byte = shift;
+	acked = 1;
+	if (expect_address) {
+	  if (swap_at && (now >= swap_at)) { // out with the old pack, in with the new
+		swap_at = 0;
+		pec = !pec;
+		battery_swap();
+		if (verbose) fprintf(stderr, "sim: pack swapped, PEC %s\n", pec ? "on" : "off");
+	  }
+	  expect_address = 0;
+	  reading = byte & 1;
+	  if (!reading) device = byte >> 1; // the read after a repeated start has to match it
+	  if ((byte >> 1) != device) acked = 0;
+	  else if ((device != address) && ((device != charger) || !charger_on)) acked = 0; // nobody there
+	  else if (sim_random() < nack_chance) acked = 0;
+	  else if (reading && (command < 0)) acked = 0; // nothing to read
+	  else if (reading) { // load the answer
+		unsigned short value;
+		if ((out_len = block(out + 1))) {
+		  out[0] = out_len++; // byte count first
+		}
+		else {
+		  word(&value);
+		  out[0] = value & 0xff;
+		  out[1] = value >> 8;
+		  out_len = 2;
+		}
+		unsigned char crc = crc8(crc8(crc8(0, msg, msg_len), &byte, 1), out, out_len);
+		out[out_len++] = pec ? crc : 0xff;
+		out_pos = 0;
+	  }
+	}
+	else if (command < 0) {
+	  unsigned short value;
+	  unsigned char buf[32];
+	  command = byte;
+	  if (!word(&value) && !block(buf)) acked = 0; // no such register
+	}
+	else if (msg_len == 4) { // PEC byte of a write
+	  if (pec && (byte != crc8(0, msg, 4))) acked = 0;
+	}
+	else if (msg_len > 4) acked = 0; // too long
+	if (msg_len < max_bytes) msg[msg_len++] = byte;
+	if (!acked) nacked = 1;
+	if (acked && (stretch > 0)) hold_until = now + stretch; // working on it
+	if (acked && (hang > 0) && (sim_random() < hang)) hold_until = now + hang_us;
+}
+//
+static void put_bit(void) // next bit of the byte being sent onto data
+{
+	unsigned char byte = (out_pos < out_len) ? out[out_pos] : 0xff;
+	pull_data = !flip((byte >> (7 - bits)) & 1);
+}
+//
+static void rising(int data) // clock went high
+{
+	if (state == receive) {
+	  shift = (shift << 1) | flip(data);
+	  bits++;
+	}
+	else if (state == send_ack) {
+	  master_ack = !data;
+	}
+}
+//
+static void falling(unsigned long long now) // clock went low
+{
+	clock_fell = now;
+	if (state == receive) {
+	  if (bits < 8) return;
+	  byte_in(now);
+	  pull_data = acked;
+	  state = receive_ack;
+	}
+	else if (state == receive_ack) { // ACK clock is over
+	  pull_data = 0;
+	  bits = 0;
+	  shift = 0;
+	  if (!acked) state = wait_stop;
+	  else if (reading) {
+		state = send;
+		put_bit();
+	  }
+	  else state = receive;
+	}
+	else if (state == send) {
+	  if (++bits < 8) {
+		put_bit();
+		return;
+	  }
+	  pull_data = 0; // let the Pi ACK
+	  state = send_ack;
+	}
+	else if (state == send_ack) {
+	  if (!master_ack) {
+		state = wait_stop; // Pi is done
+		out_pos++;
+		return;
+	  }
+	  out_pos++;
+	  bits = 0;
+	  state = send;
+	  put_bit();
+	}
+}
+//
+void slave_lines(int clock_released, int data_released, int *clock, int *data)
+{
+	unsigned long long now = sim_now();
+	int new_scl = clock_released && (now >= hold_until);
+	if ((state != idle) && !new_scl && !scl && (now - clock_fell > smbus_timeout) && (now >= hold_until)) {
+	  state = idle; // the Pi went away, let go of the bus
+	  pull_data = 0;
+	}
+	int new_sda = data_released && !pull_data;
+	if (scl && new_scl) { // clock stayed high, data edges are start and stop
+	  if (sda && !new_sda) start();
+	  else if (!sda && new_sda && (state != idle)) stop();
+	}
+	else if (!scl && new_scl) rising(new_sda);
+	else if (scl && !new_scl) falling(now);
+	scl = new_scl;
+	sda = data_released && !pull_data; // falling() may have changed what the battery drives
+	*clock = scl;
+	*data = sda;
+}
@@ -0,0 +1,39 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// How the sim pieces talk to each other: fake_gpio.c (the Pi side),
+// sbs_slave.c (the battery's SMBus interface) and battery_model.c (the
+// cells and the gauge).
+//
+#ifndef SIM_H
+#define SIM_H
+
+// fake_gpio.c
+unsigned long long sim_now(void); // sim time in usec since the program started
+int sim_pin(int pin); // what the Pi is doing to a pin, 0 = driving low, 1 = floating, 2 = driving high
+double sim_setting(const char *name, double value); // SIM_ environment variable, or value if not set
+double sim_random(void); // 0 to just under 1
+
+// sbs_slave.c
+void slave_setup(void);
+void slave_lines(int clock_released, int data_released, int *clock, int *data); // bus levels now, runs the slave on any edge
+
+// battery_model.c
+void battery_setup(void);
+int battery_word(unsigned char reg, unsigned short *value); // 0 = no such register
+int battery_block(unsigned char reg, unsigned char *buf); // byte count, 0 = not a block register
+void battery_write(unsigned char reg, unsigned short value);
+void battery_swap(void); // a new pack with another serial number
+int charger_word(unsigned char reg, unsigned short *value); // the smart charger's registers, 0 = no such register
+
+#endif
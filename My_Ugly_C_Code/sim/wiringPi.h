@@ -0,0 +1,42 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Stand-in for the wiringPi header, only the calls this code uses.
+// Building with -I sim picks this up instead of the real one, see
+// fake_gpio.c.
+//
+#ifndef WIRINGPI_SIM_H
+#define WIRINGPI_SIM_H
+
+#define INPUT 0
+#define OUTPUT 1
+#define LOW 0
+#define HIGH 1
+
+int wiringPiSetupGpio(void); // reads the SIM_ settings
+int piHiPri(int pri); // does nothing
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int value);
+int digitalRead(int pin); // takes 1 usec of sim time
+void delayMicroseconds(unsigned int us); // sim time, returns right away
+void delay(unsigned int ms);
+unsigned int micros(void);
+unsigned int millis(void);
+
+// Not wiringPi. The GPIO register file that smbus.c's /dev/gpiomem
+// transport uses instead of mapping the real one, the same pins as above
+#define SIM_GPIOMEM
+volatile unsigned int *sim_gpiomem(void);
+void sim_gpio_sync(int word, int wrote); // after a register write or before a read
+
+#endif
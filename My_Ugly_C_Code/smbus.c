@@ -0,0 +1,1020 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// SMBus transport for the laptop battery. There are a few ways to talk
+// to the battery and setupbus() picks one of them:
+//
+// 1. Bit-bang (device = NULL). Two of the Pi's GPIO pins are toggled
+// with wiringPi. SMBus Data and clock are pulled to 3.3 volts with
+// resistors on the Pi. Data is wired from Pi GPIO 2 to battery pin 4.
+// Clock is wired from Pi GPIO 3 to battery pin 3. The battery holds the
+// clock low (clock stretching) while it works on a byte, so every time
+// the Pi lets go of the clock it waits for it to really go high before
+// going on. That replaced the large worst-case delays that were measured
+// with a logic analyzer, so a read runs as fast as the battery allows.
+// If the clock is held low longer than the SMBus timeout the transfer is
+// flagged as an error. Sometimes it reads back FFFF because Linux will
+// switch to some other task and mess up the timing.
+//
+// 1a. Register bit-bang (device = "/dev/gpiomem"). Same wiring and bus
+// timing as 1, but the pins are driven by writing the GPFSEL/GPCLR
+// registers and read from GPLEV directly through /dev/gpiomem, using
+// masks worked out once in gpio_regs(). Each edge is then a single
+// register write instead of a trip through pinMode() and digitalWrite().
+// gpio_regs() can also be handed an array and a sync function that is
+// called after each register write and before each GPLEV read. Built
+// against the simulator, /dev/gpiomem is the sim's register file (see
+// sim/fake_gpio.c), so this path runs on a PC the same as wiringPi.
+//
+// 2. Kernel i2c-dev (device = "/dev/i2c-N"). Read Word and Write Word
+// are done with I2C_SMBUS ioctls so the I2C controller does the timing
+// and the program doesn't burn a core at top priority. GPIO 2/3 are the
+// Pi's I2C1 pins so no wiring change is needed, just add this line to
+// /boot/config.txt and use /dev/i2c-1:
+//     dtparam=i2c_arm=on,i2c_arm_baudrate=25000
+// The Pi's I2C controller does not handle long clock stretching well.
+// If reads fail, use the kernel's own bit-bang driver instead (it waits
+// for the clock) and use the /dev/i2c-N it creates:
+//     dtoverlay=i2c-gpio,i2c_gpio_sda=2,i2c_gpio_scl=3
+//
+// Bus worker. With bit-bang, every transaction is handed to a thread
+// that does nothing else. It runs SCHED_FIFO (bus_priority) and can be
+// pinned to one CPU (bus_cpu, -c on the command line). Give it a CPU to
+// itself by adding isolcpus=3 to /boot/cmdline.txt and running with -c 3.
+// mlockall() locks the program in RAM before the thread starts, so its
+// stack and everything it touches is already paged in and no page fault
+// can stall the bus between two edges. Callers wait for the worker to
+// finish, so only one thread drives the GPIO pins at a time. If the
+// thread can't be started (not root) it falls back to piHiPri(99).
+// Every bus delay is timed with micros(). How late each edge came
+// (actual minus intended gap, not counting clock stretching) goes into
+// a histogram, and each transaction is counted as late if any edge was
+// more than a quarter period late. bus_stats() prints it, so the effect
+// of the priority and CPU settings on bad reads can be measured.
+// Every read_word(), write_word(), read_block() and pec_probe() is also
+// timed from the call to the return, on any transport. bus_counters()
+// hands all of it to programs that export it, ie monitor_battery -m.
+//
+// Edge trace. With bus_trace set (-t on the command line), go_z(),
+// go_0() and read_pin() put every bit-bang edge on GPIO 2/3, and every
+// level the Pi reads back, into a ring of the last trace_size events
+// with a micros() time stamp, and each request marks the ring with its
+// register. That is an array store and a clock read per edge, so it can
+// be left on. When a transaction fails (NACK, timeout, PEC) or, with
+// no PEC to check it, a word reads back FFFF, the ring is written out
+// as a VCD file that GTKWave opens, named bus_trace-0.vcd to
+// bus_trace-7.vcd round robin. Point it at /run (ie -t /run/smbus_trace)
+// so the dumps go to RAM, not the SD card. Only the thread doing the job
+// writes the ring and the dump is done after the job is finished, so the
+// ring needs no lock.
+//
+// More than one device and bus. Every transaction goes to this thread's
+// device address, set with use_device() (the battery, 0x0b, until then),
+// on this thread's bus. setupbus() opens bus 0 on GPIO 2/3. openbus()
+// opens another one on any pin pair (or i2c-dev or broker), up to
+// SMBUS_MAX_BUSES, and use_bus() picks which one this thread talks to.
+// Each bit-bang bus has its own worker, edge timing counters and trace,
+// so two threads polling devices on two buses run at the same time and
+// devices on the same bus take turns one transaction at a time. error,
+// bus_error, pec and pec_error belong to the thread, so PEC can be on
+// for the battery and off for a charger that doesn't do it. The pins of
+// two bit-bang buses have to be in different groups of ten (GPIO 0-9,
+// 10-19 ...), because changing a pin's mode rewrites the function select
+// word for its whole group and two workers doing that at once would
+// undo each other. See poll_devices.c.
+//
+// 3. Broker (device = "/run/smbus_broker.sock"). smbus_broker owns the
+// bus (any of the transports above) and the programs send it their
+// reads and writes over a Unix socket, so two programs never drive
+// GPIO 2/3 at the same time. See smbus_broker.c.
+//
+// Packet Error Code (PEC). Smart batteries can follow every transfer with
+// a CRC-8 of the whole packet. When pec_probe() finds the battery does
+// this, read_word() checks the CRC with a lookup table and flags a
+// mismatch as SMBUS_PEC. It makes one try, the retry policy in sbs.c
+// decides whether to read again and counts every try. The plausibility
+// windows are only needed for batteries without PEC. pec_probe() only
+// turns PEC off after three clean reads whose PEC byte was wrong and
+// none right. A NACK or clock timeout says nothing about PEC, and if
+// that is all it gets the setting is left as it was and error is set.
+//
+// The i2c-dev transport can be tested on any Linux box without a battery
+// by loading the i2c-stub driver and presetting some registers:
+//     sudo modprobe i2c-dev
+//     sudo modprobe i2c-stub chip_addr=0x0b
+//     sudo i2cset -y N 0x0b 0x16 0x00c0 w  (N = bus number of the stub)
+//     sudo i2cset -y N 0x0b 0x09 0x2ee0 w
+//     sudo ./read_battery -d /dev/i2c-N
+//
+// Add the libsbs files, -l wiringPi, -l pthread and -l rt to the Compile & Build, ie:
+//     gcc -o read_battery read_battery.c sbs.c smbus.c telemetry.c sbs_shm.c -l wiringPi -l pthread -l rt
+//
+// Rev 1.0 - Jan 2021 - Bus code moved here from the three programs
+// Rev 1.1 - Feb 2021 - Real-time bus worker and edge timing histogram
+// Rev 1.2 - Feb 2021 - smbus_broker transport, request timing and bus_counters()
+// Rev 1.3 - Feb 2021 - Edge trace with VCD dumps of failed transactions
+// Rev 1.4 - Feb 2021 - Device addresses and more than one bus
+// Rev 1.5 - Mar 2021 - Register bit-bang runs on the simulator's register file
+//
+#define _GNU_SOURCE // CPU_SET() and pthread_attr_setaffinity_np()
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <wiringPi.h>
+#include "smbus.h"
+
+// Pin number declarations for setupbus()
+#define clock 3 // SMBus clock on Pin 5, GPIO3
+#define data 2 // SMBus data on Pin 3, GPIO2
+
+// time constants
+#define stretch_timeout 35000 // SMBus tTIMEOUT, longest the battery may hold the clock low (usec)
+
+// Packet Error Code
+#define probe_tries 8 // battery status reads pec_probe() makes before leaving PEC as it was
+
+// BCM283x GPIO register word offsets (see the BCM2835 ARM Peripherals doc)
+#define GPFSEL0 0 // function select, 10 pins per word, 3 bits per pin
+#define GPCLR0 10 // write 1 to drive an output low
+#define GPLEV0 13 // pin levels
+#define gpio_pins 54 // GPIO 0 to 53
+
+// Edge trace
+#define trace_size 8192 // events kept, a power of 2
+#define trace_files 8 // dumps kept before the first is written over
+
+// Global variables
+__thread _Bool error = 0; // set to 1 when battery gives a NACK
+__thread int bus_error = SMBUS_OK; // what went wrong first in the last transaction
+__thread _Bool pec = 0; // 1 = battery PEC bytes are read and checked, see pec_probe()
+__thread _Bool pec_error = 0; // set to 1 when the last read failed its PEC check
+int bus_priority = 99; // SCHED_FIFO priority of the bus worker
+int bus_cpu = -1; // CPU the bus worker is pinned to, -1 = any
+unsigned int bus_quarter = 10; // quarter of the bit-bang clock period in usec, 10 = 25 kHz
+const char *bus_trace = NULL; // VCD dump file name start, NULL = no edge trace
+static __thread unsigned char address = SMBUS_BATTERY; // 7 bit device address for this thread's transactions
+static volatile unsigned int *gpio = NULL; // GPIO registers, NULL = use wiringPi
+static void (*gpio_sync)(int word, int wrote) = NULL; // fake register file's hook, NULL on a Pi
+static _Bool gpio_setup = 0; // wiringPiSetupGpio() done
+static struct { // masks for each pin, worked out once by gpio_regs()
+	unsigned char fsel; // GPFSEL word for this pin
+	unsigned int fsel_mask; // the 3 function select bits
+	unsigned int fsel_out; // function select bits for output
+	unsigned char bank; // 0 for GPIO 0-31, 1 for GPIO 32-53
+	unsigned int bit; // bit in the GPCLR and GPLEV words
+} pin_reg[gpio_pins];
+enum {trace_low, trace_float, trace_saw_low, trace_saw_high, trace_request = 0xff}; // what, or pin for a request mark
+struct job { // one request for the bus
+	char op; // job_ type
+	unsigned char address; // device
+	unsigned char reg;
+	unsigned short value; // word written, or word read back
+	unsigned char *buf; // block read
+	int size; // block buffer size, then byte count back
+	_Bool pec; // the caller's PEC setting, and the setting after a probe
+	_Bool error, pec_error; // how it went
+	int bus_error;
+};
+static struct bus { // a pin pair (or i2c-dev or broker socket) and its worker
+	int scl, sda; // clock and data GPIO pins when bit-banging
+	int i2c_fd; // i2c-dev file handle, -1 when bit-banging
+	int i2c_address; // device i2c_fd is pointed at, -1 = none yet
+	int i2c_pec; // PEC setting of i2c_fd, -1 = not set yet
+	int broker_fd; // socket to smbus_broker, -1 when this program owns the bus
+	unsigned int late_hist[SMBUS_BUCKETS]; // edges by how late they were
+	unsigned long long late_total; // usec, all edges
+	unsigned int edge_end; // micros() at the end of the last bus delay
+	unsigned int tx_worst; // latest edge of this transaction (usec)
+	unsigned int tx_count, tx_bad, tx_late, tx_late_bad; // transactions: all, failed, late, late and failed
+	unsigned int requests, request_hist[SMBUS_BUCKETS]; // read_word() etc. calls and how long they took
+	unsigned long long request_total; // usec, all requests
+	pthread_mutex_t lock; // held while a job is done, by the worker or the caller
+	pthread_cond_t go, done;
+	struct job *job; // job for the worker, NULL = idle
+	pthread_t worker;
+	_Bool worker_on;
+	struct {
+	  unsigned int us; // micros()
+	  unsigned char pin; // clock, data or trace_request
+	  unsigned char what; // trace_ event, or the register for a request mark
+	} trace_ring[trace_size];
+	unsigned int trace_head; // events so far, the next goes in trace_ring[trace_head % trace_size]
+	unsigned int trace_dumps;
+} buses[SMBUS_MAX_BUSES] = {[0 ... SMBUS_MAX_BUSES - 1] = {
+	.scl = -1, .sda = -1, .i2c_fd = -1, .i2c_address = -1, .i2c_pec = -1, .broker_fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER, .go = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER}};
+static int bus_count = 0; // buses opened
+static __thread struct bus *cur = &buses[0]; // this thread's bus
+
+// Functions
+static void trace(struct bus *b, unsigned char pin, unsigned char what) // add an event to the bus's edge trace
+{
+	unsigned int last = (b->trace_head - 1) & (trace_size - 1);
+	if ((what >= trace_saw_low) && (b->trace_head > 0) && (b->trace_ring[last].pin == pin) && (b->trace_ring[last].what == what)) {
+	  return; // same level read again, ie waiting out a clock stretch
+	}
+	unsigned int i = b->trace_head & (trace_size - 1);
+	b->trace_ring[i].us = micros();
+	b->trace_ring[i].pin = pin;
+	b->trace_ring[i].what = what;
+	b->trace_head++;
+}
+//
+void gpio_regs(volatile unsigned int *regs, void (*sync)(int word, int wrote)) // drive pins through these registers
+{
+	gpio = regs; // NULL goes back to wiringPi
+	gpio_sync = sync;
+	for (int pin=0; pin<gpio_pins; pin++) {
+	  pin_reg[pin].fsel = GPFSEL0 + pin / 10;
+	  pin_reg[pin].fsel_mask = 7 << ((pin % 10) * 3);
+	  pin_reg[pin].fsel_out = 1 << ((pin % 10) * 3); // 001 = output, 000 = input
+	  pin_reg[pin].bank = pin / 32;
+	  pin_reg[pin].bit = 1 << (pin % 32);
+	}
+}
+//
+void go_z(int pin) // float the pin and let pullup or battery set level
+{
+	if (bus_trace && ((pin == cur->scl) || (pin == cur->sda))) trace(cur, pin, trace_float);
+	if (gpio) { // input function select tri-states the driver
+	  gpio[pin_reg[pin].fsel] &= ~pin_reg[pin].fsel_mask;
+	  if (gpio_sync) gpio_sync(pin_reg[pin].fsel, 1);
+	  return;
+	}
+	pinMode(pin, INPUT); // set pin as input to tri-state the driver
+}
+//
+void go_0(int pin) // drive the pin low
+{
+	if (bus_trace && ((pin == cur->scl) || (pin == cur->sda))) trace(cur, pin, trace_low);
+	if (gpio) { // clear the output latch, then turn the driver on
+	  gpio[GPCLR0 + pin_reg[pin].bank] = pin_reg[pin].bit;
+	  if (gpio_sync) gpio_sync(GPCLR0 + pin_reg[pin].bank, 1);
+	  gpio[pin_reg[pin].fsel] = (gpio[pin_reg[pin].fsel] & ~pin_reg[pin].fsel_mask) | pin_reg[pin].fsel_out;
+	  if (gpio_sync) gpio_sync(pin_reg[pin].fsel, 1);
+	  return;
+	}
+	pinMode(pin, OUTPUT); // set pin as output
+	digitalWrite(pin, LOW); // drive pin low
+}
+//
+int read_pin(int pin) // read the pin and return logic level
+{
+	int level;
+	if (gpio) {
+	  gpio[pin_reg[pin].fsel] &= ~pin_reg[pin].fsel_mask; // set pin as input
+	  if (gpio_sync) {
+		gpio_sync(pin_reg[pin].fsel, 1);
+		gpio_sync(GPLEV0 + pin_reg[pin].bank, 0);
+	  }
+	  level = ((gpio[GPLEV0 + pin_reg[pin].bank] & pin_reg[pin].bit) != 0);
+	}
+	else {
+	  pinMode(pin, INPUT); // set pin as input
+	  level = digitalRead(pin); // the logic level
+	}
+	if (bus_trace && ((pin == cur->scl) || (pin == cur->sda))) trace(cur, pin, level ? trace_saw_high : trace_saw_low);
+	return level;
+}
+//
+static int gpiomem_open(const char *device) // map the GPIO block for go_z/go_0/read_pin
+{
+#ifdef SIM_GPIOMEM // built against the simulator, its register file stands in for the GPIO block
+	(void)device;
+	gpio_regs(sim_gpiomem(), sim_gpio_sync);
+	return 0;
+#else
+	int fd = open(device, O_RDWR | O_SYNC);
+	if (fd < 0)
+	{
+		perror(device);
+		return -1;
+	}
+	void *regs = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd); // the mapping stays valid
+	if (regs == MAP_FAILED)
+	{
+		perror("mmap");
+		return -1;
+	}
+	gpio_regs(regs, NULL);
+	return 0;
+#endif
+}
+//
+void set_pec(_Bool on) // send and check PEC bytes on every transfer
+{
+	if (cur->broker_fd >= 0) return; // the broker decides, its setting comes back with each reply
+	pec = on; // the kernel driver is told just before the next transfer, see i2c_smbus()
+}
+//
+void use_device(unsigned char device) // 7 bit address this thread's transactions go to
+{
+	address = device;
+}
+//
+void use_bus(int bus) // bus this thread's transactions go on, from openbus()
+{
+	if ((bus >= 0) && (bus < bus_count)) cur = &buses[bus];
+}
+//
+static _Bool same_group(int pin, const struct bus *b) // pin shares a function select word with a bit-bang bus?
+{
+	return (b->i2c_fd < 0) && (b->broker_fd < 0) && ((pin / 10 == b->scl / 10) || (pin / 10 == b->sda / 10));
+}
+//
+void setupgpio(void)
+{
+	if (gpio_setup) return;
+	wiringPiSetupGpio(); //Init wiringPi using the Broadcom GPIO numbers
+	gpio_setup = 1;
+}
+//
+static void start_worker(struct bus *b);
+int openbus(const char *device, int clock_pin, int data_pin)
+{
+	if (bus_count == SMBUS_MAX_BUSES)
+	{
+		fprintf(stderr, "openbus: no more than %d buses\n", SMBUS_MAX_BUSES);
+		return -1;
+	}
+	struct bus *b = &buses[bus_count]; // a failed open leaves it as it was
+	b->scl = clock_pin;
+	b->sda = data_pin;
+	if ((device != NULL) && (strstr(device, ".sock") != NULL)) // smbus_broker owns the bus
+	{
+		struct sockaddr_un addr = {.sun_family = AF_UNIX};
+		strncpy(addr.sun_path, device, sizeof(addr.sun_path) - 1);
+		b->broker_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+		if ((b->broker_fd < 0) || connect(b->broker_fd, (struct sockaddr *)&addr, sizeof(addr)))
+		{
+			perror(device); // is smbus_broker running?
+			if (b->broker_fd >= 0) close(b->broker_fd);
+			b->broker_fd = -1;
+			return -1;
+		}
+	}
+	else if ((device == NULL) || (strstr(device, "gpiomem") != NULL)) // bit-bang the bus on the pin pair
+	{
+		if ((clock_pin < 0) || (clock_pin >= gpio_pins) || (data_pin < 0) || (data_pin >= gpio_pins) || (clock_pin == data_pin))
+		{
+			fprintf(stderr, "openbus: bad pins %d,%d\n", clock_pin, data_pin);
+			return -1;
+		}
+		for (int i=0; i<bus_count; i++) {
+		  if (same_group(clock_pin, &buses[i]) || same_group(data_pin, &buses[i]))
+		  {
+			fprintf(stderr, "openbus: GPIO %d,%d are in the same group of ten as bus %d\n", clock_pin, data_pin, i);
+			return -1;
+		  }
+		}
+		setupgpio(); // only bit-bang needs wiringPi (and root), broker and i2c-dev clients don't
+		if ((device != NULL) && (gpio == NULL) && gpiomem_open(device)) return -1; // one mapping for every bus
+		cur = b;
+		go_z(clock_pin); // set clock and data to inactive state
+		go_z(data_pin);
+		delayMicroseconds(200); // wait before sending data
+		start_worker(b); // real-time bus thread, see the top of this file
+	}
+	else // Kernel driver. Don't touch the pins, they belong to the I2C controller
+	{
+		b->i2c_fd = open(device, O_RDWR);
+		if (b->i2c_fd < 0)
+		{
+			perror(device);
+			return -1;
+		}
+		if (ioctl(b->i2c_fd, I2C_SLAVE, address) < 0) // check the device is free to use now, not at the first read
+		{
+			perror("I2C_SLAVE");
+			close(b->i2c_fd);
+			b->i2c_fd = -1;
+			return -1;
+		}
+		b->i2c_address = address;
+	}
+	cur = b;
+	return bus_count++;
+}
+//
+int setupbus(const char *device)
+{
+	return (openbus(device, clock, data) < 0) ? -1 : 0; // GPIO 2 and 3
+}
+//
+static int bucket(unsigned int us) // histogram bucket, 0, 1, 2-3, 4-7 ...
+{
+	int b = 0;
+	while ((us >> b) && (b < SMBUS_BUCKETS - 1)) b++;
+	return b;
+}
+//
+static void bus_wait(unsigned int us) // bus delay, records how late the edge after it will be
+{
+	delayMicroseconds(us);
+	unsigned int now = micros();
+	unsigned int late = now - cur->edge_end; // time since the last delay ended, incl. pin changes
+	late = (late > us) ? late - us : 0;
+	cur->edge_end = now;
+	cur->late_hist[bucket(late)]++;
+	cur->late_total += late;
+	if (late > cur->tx_worst) cur->tx_worst = late;
+}
+//
+static void clock_high(void) // release the clock and wait for the battery to let it go high
+{
+	go_z(cur->scl); // clock high
+	if (read_pin(cur->scl)) return; // battery isn't stretching the clock
+	unsigned int start = micros();
+	while (!read_pin(cur->scl)) { // battery is holding the clock low
+	  if ((micros() - start) > stretch_timeout) {
+		error = 1; // clock stuck low, give up on this transfer
+		if (bus_error == SMBUS_OK) bus_error = SMBUS_TIMEOUT;
+		break;
+	  }
+	}
+	cur->edge_end = micros(); // the battery's stretch doesn't count as late
+}
+//
+void startbus(void)
+{
+	cur->edge_end = micros(); // start timing edges for this transaction
+	cur->tx_worst = 0;
+	bus_wait(bus_quarter); // bus free time since the last stop
+	go_0(cur->sda);	// start condition - data low when clock goes low
+	bus_wait(bus_quarter);
+	go_0(cur->scl);
+	bus_wait(bus_quarter);
+}
+//
+void send8(char sendbits)
+{
+	// send bits 7 down to 0, using a mask that starts with 10000000
+	// and gets shifted right 1 bit each loop
+	char mask = 0x80;
+	for (char j=0; j<8; j++)   {  //loop 8 times
+	  if (!(sendbits & mask)) { // check if mask bit is low
+        go_0(cur->sda); // send low
+	  }
+	  else
+	  {
+		go_z(cur->sda); // send high
+	  }
+ 	  bus_wait(bus_quarter);
+	  clock_high(); // clock high, battery may stretch it
+	  bus_wait(bus_quarter * 2);
+	  go_0(cur->scl); // clock low
+	  bus_wait(bus_quarter);
+      mask = mask >> 1; // shift mask 1 bit to the right
+    }
+	// ack/nack
+	go_z(cur->sda); // float data to see ack
+	bus_wait(bus_quarter);
+	clock_high(); // clock high, waits while the battery works on the byte
+	// read data to see if battery sends a low (acknowledge transfer)
+	if (read_pin(cur->sda))
+	{
+		error = 1; // battery did not acknowledge the transfer
+	}
+	bus_wait(bus_quarter * 2);
+	go_0(cur->scl); // clock low
+	go_0(cur->sda); // data low
+	bus_wait(bus_quarter);
+}
+//
+void sendrptstart(void) // send repeated start condition
+{
+	go_z(cur->sda); // data high
+	bus_wait(bus_quarter);
+	clock_high(); // clock high
+	bus_wait(bus_quarter * 2);
+	go_0(cur->sda); // data low
+	bus_wait(bus_quarter * 2);
+	go_0(cur->scl); // clock low
+	bus_wait(bus_quarter);
+}
+//
+static int read8(_Bool ack) // read a byte, then ack (more to come) or nack (last byte)
+{
+	int readval = 0x00;
+	for (int k=0; k<8; k++) {
+	  go_z(cur->sda); // let the battery drive data
+	  bus_wait(bus_quarter);
+	  clock_high(); // clock high, battery may stretch it
+	  bus_wait(bus_quarter);
+	  readval = (readval << 1) | read_pin(cur->sda); // data is valid while clock is high
+	  bus_wait(bus_quarter);
+	  go_0(cur->scl); // clock low
+	  bus_wait(bus_quarter);
+    }
+	if (ack) {
+	  go_0(cur->sda); // send ack back to battery
+	}
+	else {
+	  go_z(cur->sda); // send nack back to battery
+	}
+	bus_wait(bus_quarter);
+	clock_high(); // clock high
+	bus_wait(bus_quarter * 2);
+	go_0(cur->scl); // clock low
+	go_0(cur->sda); // data low
+	bus_wait(bus_quarter);
+	return readval;
+}
+//
+int read16(void) // read low byte and high byte, return the 16 bit word
+{
+	int readval = read8(1); // low byte, ack it
+	readval = readval | (read8(0) << 8); // high byte, nack it
+	return readval;
+}
+//
+void stopbus(void) // stop condition, data low when clock goes high
+{
+	clock_high(); // clock high
+	bus_wait(bus_quarter);
+	go_z(cur->sda);	// data high
+	bus_wait(bus_quarter);
+	cur->tx_count++; // end of a transaction, count it
+	if (error) cur->tx_bad++;
+	if (cur->tx_worst > bus_quarter) {
+	  cur->tx_late++; // an edge was off by more than a quarter period
+	  if (error) cur->tx_late_bad++;
+	}
+}
+//
+static void print_hist(FILE *out, const char *title, const unsigned int *hist)
+{
+	fprintf(out, "%s (usec):", title);
+	for (int i=0; i<SMBUS_BUCKETS; i++) {
+	  if (hist[i] == 0) continue;
+	  if (i == 0) fprintf(out, " 0:%u", hist[i]);
+	  else if (i == SMBUS_BUCKETS - 1) fprintf(out, " %u+:%u", 1u << (i - 1), hist[i]);
+	  else fprintf(out, " %u-%u:%u", 1u << (i - 1), (1u << i) - 1, hist[i]);
+	}
+	fprintf(out, "\n");
+}
+//
+void bus_stats(FILE *out) // print the edge timing histogram of this thread's bus
+{
+	fprintf(out, "Bus transactions %u, failed %u, late %u, late and failed %u\n",
+		cur->tx_count, cur->tx_bad, cur->tx_late, cur->tx_late_bad);
+	print_hist(out, "Edges late by", cur->late_hist);
+	print_hist(out, "Requests took", cur->request_hist);
+	if (bus_trace) fprintf(out, "Edge trace dumps %u\n", cur->trace_dumps);
+}
+//
+void bus_counters(struct smbus_counters *out)
+{
+	out->requests = cur->requests;
+	memcpy(out->request_hist, cur->request_hist, sizeof(cur->request_hist));
+	out->request_us = cur->request_total;
+	out->transactions = cur->tx_count;
+	out->failed = cur->tx_bad;
+	out->late = cur->tx_late;
+	out->late_failed = cur->tx_late_bad;
+	memcpy(out->late_hist, cur->late_hist, sizeof(cur->late_hist));
+	out->late_us = cur->late_total;
+}
+//
+static const unsigned char crc8_table[256] = { // CRC-8, x^8 + x^2 + x + 1 (SMBus PEC)
+	0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15, 0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d,
+	0x70, 0x77, 0x7e, 0x79, 0x6c, 0x6b, 0x62, 0x65, 0x48, 0x4f, 0x46, 0x41, 0x54, 0x53, 0x5a, 0x5d,
+	0xe0, 0xe7, 0xee, 0xe9, 0xfc, 0xfb, 0xf2, 0xf5, 0xd8, 0xdf, 0xd6, 0xd1, 0xc4, 0xc3, 0xca, 0xcd,
+	0x90, 0x97, 0x9e, 0x99, 0x8c, 0x8b, 0x82, 0x85, 0xa8, 0xaf, 0xa6, 0xa1, 0xb4, 0xb3, 0xba, 0xbd,
+	0xc7, 0xc0, 0xc9, 0xce, 0xdb, 0xdc, 0xd5, 0xd2, 0xff, 0xf8, 0xf1, 0xf6, 0xe3, 0xe4, 0xed, 0xea,
+	0xb7, 0xb0, 0xb9, 0xbe, 0xab, 0xac, 0xa5, 0xa2, 0x8f, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9d, 0x9a,
+	0x27, 0x20, 0x29, 0x2e, 0x3b, 0x3c, 0x35, 0x32, 0x1f, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0d, 0x0a,
+	0x57, 0x50, 0x59, 0x5e, 0x4b, 0x4c, 0x45, 0x42, 0x6f, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7d, 0x7a,
+	0x89, 0x8e, 0x87, 0x80, 0x95, 0x92, 0x9b, 0x9c, 0xb1, 0xb6, 0xbf, 0xb8, 0xad, 0xaa, 0xa3, 0xa4,
+	0xf9, 0xfe, 0xf7, 0xf0, 0xe5, 0xe2, 0xeb, 0xec, 0xc1, 0xc6, 0xcf, 0xc8, 0xdd, 0xda, 0xd3, 0xd4,
+	0x69, 0x6e, 0x67, 0x60, 0x75, 0x72, 0x7b, 0x7c, 0x51, 0x56, 0x5f, 0x58, 0x4d, 0x4a, 0x43, 0x44,
+	0x19, 0x1e, 0x17, 0x10, 0x05, 0x02, 0x0b, 0x0c, 0x21, 0x26, 0x2f, 0x28, 0x3d, 0x3a, 0x33, 0x34,
+	0x4e, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5c, 0x5b, 0x76, 0x71, 0x78, 0x7f, 0x6a, 0x6d, 0x64, 0x63,
+	0x3e, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2c, 0x2b, 0x06, 0x01, 0x08, 0x0f, 0x1a, 0x1d, 0x14, 0x13,
+	0xae, 0xa9, 0xa0, 0xa7, 0xb2, 0xb5, 0xbc, 0xbb, 0x96, 0x91, 0x98, 0x9f, 0x8a, 0x8d, 0x84, 0x83,
+	0xde, 0xd9, 0xd0, 0xd7, 0xc2, 0xc5, 0xcc, 0xcb, 0xe6, 0xe1, 0xe8, 0xef, 0xfa, 0xfd, 0xf4, 0xf3,
+};
+//
+unsigned char crc8(unsigned char crc, const unsigned char *buf, int len) // update a PEC over len bytes
+{
+	for (int i=0; i<len; i++) {
+	  crc = crc8_table[crc ^ buf[i]];
+	}
+	return crc;
+}
+//
+static void nack(int what) // classify a NACK of the byte just sent, if it was the first problem
+{
+	if (error && (bus_error == SMBUS_OK)) bus_error = what;
+}
+//
+static int i2c_error(void) // errno from an I2C_SMBUS ioctl to a bus_error code
+{
+	switch (errno) {
+	  case ENXIO: return SMBUS_ADDR_NACK; // nobody answered the address
+	  case EREMOTEIO: return SMBUS_REG_NACK; // NACK later on, the driver doesn't say where
+	  case ETIMEDOUT: return SMBUS_TIMEOUT; // clock held low
+	  case EBADMSG: return SMBUS_PEC; // kernel checked the PEC and it was wrong
+	  default: return SMBUS_FAILED;
+	}
+}
+//
+static int i2c_smbus(char read_write, unsigned char reg, int size, union i2c_smbus_data *value)
+{
+	// Point the driver at this thread's device, with its PEC setting
+	if (cur->i2c_address != address) {
+	  if (ioctl(cur->i2c_fd, I2C_SLAVE, address) < 0) return -1; // errno says why
+	  cur->i2c_address = address;
+	}
+	if (cur->i2c_pec != pec) {
+	  ioctl(cur->i2c_fd, I2C_PEC, pec); // kernel adds and checks the PEC byte
+	  cur->i2c_pec = pec;
+	}
+	// same as i2c_smbus_access() in libi2c. Fields are read_write, command,
+	// size and data (can't name that last one, data is the pin #define)
+	struct i2c_smbus_ioctl_data args = {read_write, reg, size, value};
+	return ioctl(cur->i2c_fd, I2C_SMBUS, &args);
+}
+//
+static unsigned short bus_read_word(unsigned char reg) // one Read Word transaction, retries are up to the caller (sbs.c)
+{
+	error = 0; // initialize to no error
+	pec_error = 0;
+	bus_error = SMBUS_OK;
+	if (cur->i2c_fd >= 0) // kernel driver does the whole transaction
+	{
+		union i2c_smbus_data value;
+		if (i2c_smbus(I2C_SMBUS_READ, reg, I2C_SMBUS_WORD_DATA, &value) < 0)
+		{
+			error = 1; // NACK, arbitration loss or timeout
+			bus_error = i2c_error();
+			pec_error = (bus_error == SMBUS_PEC);
+			return 0xffff; // same as a bit-bang read with nobody driving data
+		}
+		return value.word;
+	}
+	unsigned char packet[5] = {address << 1, reg, (address << 1) | 1, 0, 0}; // bytes covered by the PEC
+	startbus(); // send start condition
+	send8(packet[0]); // send device address w/ write (0x16 for the battery)
+	nack(SMBUS_ADDR_NACK);
+	send8(reg); // load register pointer
+	nack(SMBUS_REG_NACK);
+	sendrptstart(); // send repeated start condition
+	send8(packet[2]); // send device address w/ read (0x17 for the battery)
+	nack(SMBUS_READ_NACK);
+	packet[3] = read8(1); // low byte, ack it
+	packet[4] = read8(pec); // high byte, ack it if the PEC byte follows
+	if (pec && (read8(0) != crc8(0, packet, 5))) // PEC byte, nack it
+	{
+		if (!error) bus_error = SMBUS_PEC; // a NACK before it is the real problem
+		error = 1;
+		pec_error = 1; // a bit got corrupted somewhere
+	}
+	stopbus(); // send stop condition
+	return packet[3] | (packet[4] << 8);
+}
+//
+static void bus_write_word(unsigned char reg, unsigned short value) // write a 16 bit battery register
+{
+	error = 0; // initialize to no error
+	bus_error = SMBUS_OK;
+	if (cur->i2c_fd >= 0)
+	{
+		union i2c_smbus_data word;
+		word.word = value;
+		if (i2c_smbus(I2C_SMBUS_WRITE, reg, I2C_SMBUS_WORD_DATA, &word) < 0)
+		{
+			error = 1;
+			bus_error = i2c_error();
+		}
+		return;
+	}
+	unsigned char packet[4] = {address << 1, reg, value & 0xff, value >> 8};
+	startbus(); // send start condition
+	send8(packet[0]); // send device address w/ write (0x16 for the battery)
+	nack(SMBUS_ADDR_NACK);
+	send8(reg); // load register pointer
+	nack(SMBUS_REG_NACK);
+	// Note: there is no repeated start on a write
+	send8(value & 0xff); // send low byte
+	send8(value >> 8); // send high byte
+	nack(SMBUS_DATA_NACK);
+	if (pec) {
+	  send8(crc8(0, packet, 4)); // battery drops the write if this is wrong
+	  nack(SMBUS_PEC); // battery NACKs a bad PEC byte
+	}
+	stopbus(); // send stop condition
+}
+//
+static int bus_read_block(unsigned char reg, unsigned char *buf, int size) // SMBus Block Read, returns byte count
+{
+	error = 0; // initialize to no error
+	pec_error = 0;
+	bus_error = SMBUS_OK;
+	if (cur->i2c_fd >= 0)
+	{
+		union i2c_smbus_data block; // block[0] is the count
+		if (i2c_smbus(I2C_SMBUS_READ, reg, I2C_SMBUS_BLOCK_DATA, &block) < 0)
+		{
+			error = 1;
+			bus_error = i2c_error();
+			pec_error = (bus_error == SMBUS_PEC);
+			return -1;
+		}
+		int count = (block.block[0] < size) ? block.block[0] : size;
+		memcpy(buf, &block.block[1], count);
+		return count;
+	}
+	unsigned char packet[4 + 32] = {address << 1, reg, (address << 1) | 1}; // bytes covered by the PEC
+	startbus(); // send start condition
+	send8(packet[0]); // send device address w/ write (0x16 for the battery)
+	nack(SMBUS_ADDR_NACK);
+	send8(reg); // load register pointer
+	nack(SMBUS_REG_NACK);
+	sendrptstart(); // send repeated start condition
+	send8(packet[2]); // send device address w/ read (0x17 for the battery)
+	nack(SMBUS_READ_NACK);
+	int count = read8(1); // byte count, ack it
+	if ((count == 0) || (count > 32)) // not a block register, or a bad read
+	{
+		read8(0); // nack a byte so the battery lets go of the bus
+		stopbus(); // send stop condition
+		if (!error) bus_error = SMBUS_FAILED; // count makes no sense
+		error = 1;
+		return -1;
+	}
+	packet[3] = count;
+	for (int i=0; i<count; i++) {
+	  packet[4 + i] = read8((i < count - 1) || pec); // nack the last byte
+	}
+	if (pec && (read8(0) != crc8(0, packet, 4 + count)))
+	{
+		if (!error) bus_error = SMBUS_PEC;
+		error = 1;
+		pec_error = 1;
+	}
+	stopbus(); // send stop condition
+	if (error) return -1;
+	if (count > size) count = size;
+	memcpy(buf, &packet[4], count);
+	return count;
+}
+//
+static _Bool bus_pec_probe(void) // turn PEC on if the battery sends good PEC bytes
+{
+	_Bool was = pec; // kept if the bus never gives a clean answer
+	int match = 0, mismatch = 0;
+	set_pec(1);
+	// Battery status with a PEC byte. Only a read that got all the way to
+	// the PEC byte with no NACK or timeout says anything about PEC, a bus
+	// error is just read again. A flipped bit also makes a bad PEC byte,
+	// so one good one outweighs any number of bad ones.
+	for (int i=0; (i<probe_tries) && (match < 2) && ((mismatch < 3) || match); i++) {
+	  bus_read_word(0x16);
+	  if (!error) match++;
+	  else if (bus_error == SMBUS_PEC) mismatch++; // clean transfer, the CRC byte was wrong
+	}
+	if (match) set_pec(1);
+	else if (mismatch >= 3) set_pec(0);
+	else {
+	  set_pec(was);
+	  return pec; // error and bus_error are the last try's
+	}
+	error = 0; // it found out
+	bus_error = SMBUS_OK;
+	pec_error = 0;
+	return pec;
+}
+//
+static void trace_bits(FILE *out, unsigned char value) // VCD vector value
+{
+	fputc('b', out);
+	for (int i=7; i>=0; i--) fputc('0' + ((value >> i) & 1), out);
+	fputs(" r\n", out);
+}
+//
+static void trace_dump(struct bus *b) // write a bus's edge trace out as a VCD file, with its lock held
+{
+	if (!bus_trace || (b->trace_head == 0)) return;
+	char path[256];
+	if (b == &buses[0]) snprintf(path, sizeof(path), "%s-%u.vcd", bus_trace, b->trace_dumps++ % trace_files);
+	else snprintf(path, sizeof(path), "%s-bus%d-%u.vcd", bus_trace, (int)(b - buses), b->trace_dumps++ % trace_files);
+	FILE *out = fopen(path, "w");
+	if (out == NULL)
+	{
+		perror(path);
+		return;
+	}
+	time_t now = time(NULL);
+	fprintf(out, "$date %s$end\n", ctime(&now)); // ctime() ends in a newline
+	fprintf(out, "$version smbus.c edge trace $end\n$timescale 1us $end\n$scope module smbus $end\n");
+	fprintf(out, "$var wire 1 c scl_pi $end\n"); // 0 = the Pi drives it low, z = let go
+	fprintf(out, "$var wire 1 d sda_pi $end\n");
+	fprintf(out, "$var wire 1 C scl $end\n"); // level the Pi read back
+	fprintf(out, "$var wire 1 D sda $end\n");
+	fprintf(out, "$var event 1 s sda_sample $end\n"); // each time the Pi read data
+	fprintf(out, "$var wire 8 r register $end\n"); // register of each request
+	fprintf(out, "$upscope $end\n$enddefinitions $end\n$dumpvars\nxc\nxd\nxC\nxD\nbxxxxxxxx r\n$end\n");
+	unsigned int first = (b->trace_head > trace_size) ? b->trace_head - trace_size : 0;
+	unsigned int start = b->trace_ring[first & (trace_size - 1)].us;
+	unsigned int last = 0;
+	for (unsigned int n=first; n!=b->trace_head; n++) {
+	  unsigned int i = n & (trace_size - 1);
+	  unsigned int t = b->trace_ring[i].us - start;
+	  if ((n == first) || (t != last)) fprintf(out, "#%u\n", t);
+	  last = t;
+	  unsigned char what = b->trace_ring[i].what;
+	  if (b->trace_ring[i].pin == trace_request) {
+		trace_bits(out, what);
+		continue;
+	  }
+	  const char *id = (b->trace_ring[i].pin == b->scl) ? "cC" : "dD"; // driven, read back
+	  if (what == trace_low) fprintf(out, "0%c\n", id[0]);
+	  else if (what == trace_float) fprintf(out, "z%c\n", id[0]);
+	  else {
+		fprintf(out, "%c%c\n", (what == trace_saw_high) ? '1' : '0', id[1]);
+		if (b->trace_ring[i].pin == b->sda) fprintf(out, "1s\n");
+	  }
+	}
+	fclose(out);
+}
+//
+void bus_trace_dump(void) // write this thread's bus edge trace to the next VCD file
+{
+	pthread_mutex_lock(&cur->lock); // nothing is added to the ring while it is written out
+	trace_dump(cur);
+	pthread_mutex_unlock(&cur->lock);
+}
+//
+// Bus worker thread
+enum {job_read_word = 'r', job_write_word = 'w', job_read_block = 'b', job_pec_probe = 'p'}; // same as smbus_request op
+//
+static void broker_job(struct job *j) // send the job to smbus_broker and wait for the answer
+{
+	struct smbus_request req = {j->op, j->reg, j->value, j->address};
+	struct smbus_reply reply;
+	if ((send(cur->broker_fd, &req, sizeof(req), 0) != sizeof(req)) ||
+	   (recv(cur->broker_fd, &reply, sizeof(reply), 0) != sizeof(reply)))
+	{
+		error = 1; // broker went away
+		bus_error = SMBUS_FAILED;
+		j->value = 0xffff;
+		j->size = -1;
+		return;
+	}
+	error = reply.error;
+	bus_error = reply.bus_error;
+	pec = reply.pec;
+	pec_error = (bus_error == SMBUS_PEC);
+	j->value = reply.value;
+	if (j->op == job_read_block) {
+	  int count = (reply.count < j->size) ? reply.count : j->size;
+	  if (count > 0) memcpy(j->buf, reply.block, count);
+	  j->size = count;
+	}
+	else if (j->op == job_pec_probe) {
+	  j->size = reply.value;
+	}
+}
+//
+static void do_job(struct job *j) // on cur, with its lock held
+{
+	address = j->address; // the worker takes on the caller's device and PEC setting
+	pec = j->pec;
+	if (cur->broker_fd >= 0) {
+	  broker_job(j);
+	}
+	else switch (j->op) {
+	  case job_read_word: j->value = bus_read_word(j->reg); break;
+	  case job_write_word: bus_write_word(j->reg, j->value); break;
+	  case job_read_block: j->size = bus_read_block(j->reg, j->buf, j->size); break;
+	  case job_pec_probe: j->size = bus_pec_probe(); break;
+	}
+	j->error = error; // and hands back how it went
+	j->bus_error = bus_error;
+	j->pec_error = pec_error;
+	j->pec = pec;
+}
+//
+static void *worker_loop(void *arg) // runs every bus transaction on one bus at real-time priority
+{
+	cur = arg;
+	pthread_mutex_lock(&cur->lock);
+	while (1) {
+	  while (!cur->job) pthread_cond_wait(&cur->go, &cur->lock);
+	  do_job(cur->job);
+	  cur->job = NULL;
+	  pthread_cond_broadcast(&cur->done); // the caller, and anyone waiting for the bus
+	}
+	return NULL;
+}
+//
+static void run_job(struct job *j) // do the job in the bus worker, or right here if there isn't one
+{
+	struct bus *b = cur;
+	struct timespec start, end;
+	j->address = address;
+	j->pec = pec;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_mutex_lock(&b->lock);
+	while (b->job) pthread_cond_wait(&b->done, &b->lock); // another thread's job goes first
+	if (bus_trace) trace(b, trace_request, j->reg); // the worker is idle, so this thread can add to the ring
+	if (!b->worker_on) {
+	  do_job(j);
+	}
+	else {
+	  b->job = j;
+	  pthread_cond_signal(&b->go);
+	  while (b->job == j) pthread_cond_wait(&b->done, &b->lock);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	unsigned int us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+	b->requests++;
+	b->request_hist[bucket(us)]++;
+	b->request_total += us;
+	if (bus_trace && (b->i2c_fd < 0) && (b->broker_fd < 0) && (j->op != job_pec_probe) &&
+	   (j->error || ((j->op == job_read_word) && (j->value == 0xffff) && !j->pec))) {
+	  trace_dump(b); // failed, or nobody drove data (with PEC a bad FFFF is a PEC error)
+	}
+	pthread_mutex_unlock(&b->lock);
+	error = j->error;
+	bus_error = j->bus_error;
+	pec_error = j->pec_error;
+	pec = j->pec;
+}
+//
+static void start_worker(struct bus *b) // real-time thread for a bit-bang bus
+{
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) { // the thread's stack gets locked as it is made
+	  perror("mlockall"); // not fatal, page faults are just less likely than preemption
+	}
+	pthread_attr_t attr;
+	struct sched_param param = {.sched_priority = bus_priority};
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	pthread_attr_setschedparam(&attr, &param);
+	if (bus_cpu >= 0) {
+	  cpu_set_t cpus;
+	  CPU_ZERO(&cpus);
+	  CPU_SET(bus_cpu, &cpus);
+	  pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	}
+	int err = pthread_create(&b->worker, &attr, worker_loop, b);
+	pthread_attr_destroy(&attr);
+	if (err) {
+	  fprintf(stderr, "bus worker: %s, using piHiPri instead\n", strerror(err));
+	  piHiPri(99); //Make program the highest priority (still gets interrupted sometimes)
+	  return;
+	}
+	b->worker_on = 1;
+}
+//
+unsigned short read_word(unsigned char reg) // read a 16 bit register of this thread's device
+{
+	struct job j = {.op = job_read_word, .reg = reg};
+	run_job(&j);
+	return j.value;
+}
+//
+void write_word(unsigned char reg, unsigned short value) // write a 16 bit register
+{
+	struct job j = {.op = job_write_word, .reg = reg, .value = value};
+	run_job(&j);
+}
+//
+int read_block(unsigned char reg, unsigned char *buf, int size) // SMBus Block Read, returns byte count
+{
+	struct job j = {.op = job_read_block, .reg = reg, .buf = buf, .size = size};
+	run_job(&j);
+	return j.size;
+}
+//
+_Bool pec_probe(void) // turn PEC on if the device sends good PEC bytes
+{
+	struct job j = {.op = job_pec_probe};
+	run_job(&j);
+	return j.size;
+}
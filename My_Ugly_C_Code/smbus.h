@@ -0,0 +1,116 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// SMBus transport shared by read_battery, read_battery_loop,
+// monitor_battery and poll_devices. See smbus.c for the wiring, the
+// transports and how more than one device and bus are handled.
+//
+#ifndef SMBUS_H
+#define SMBUS_H
+
+#include <stdio.h>
+
+// Default transport. NULL bit-bangs GPIO 2/3 with wiringPi.
+// Build with -DSMBUS_DEVICE=\"/dev/i2c-1\" to default to the kernel driver.
+// The programs also take -d /dev/i2c-N (kernel), -d /dev/gpiomem (bit-bang
+// with direct register access), -d /run/smbus_broker.sock (ask smbus_broker
+// to do it) or -g (bit-bang with wiringPi) at run time.
+#ifndef SMBUS_DEVICE
+#define SMBUS_DEVICE NULL
+#endif
+
+// Device addresses (7 bit)
+#define SMBUS_BATTERY 0x0b // smart battery, 0x16 w/ write and 0x17 w/ read
+#define SMBUS_CHARGER 0x09 // smart battery charger
+
+#define SMBUS_MAX_BUSES 4 // openbus() calls
+
+// What went wrong in a transaction, first problem wins
+enum {
+	SMBUS_OK, // no problem
+	SMBUS_ADDR_NACK, // battery address (0x16) not acknowledged, nobody there or busy
+	SMBUS_REG_NACK, // register pointer not acknowledged
+	SMBUS_READ_NACK, // read address (0x17) after the repeated start not acknowledged
+	SMBUS_DATA_NACK, // write data not acknowledged
+	SMBUS_TIMEOUT, // clock held low longer than the SMBus timeout
+	SMBUS_PEC, // PEC byte didn't match
+	SMBUS_FAILED, // anything else (bad block count, kernel driver error)
+	SMBUS_ERRORS // number of codes
+};
+
+// These four are the calling thread's own
+extern __thread _Bool error; // set to 1 when the last transfer got a NACK or failed
+extern __thread int bus_error; // SMBUS_ code for the last transfer
+extern __thread _Bool pec; // 1 when PEC bytes are checked, range checks can be skipped
+extern __thread _Bool pec_error; // set to 1 when the last read failed its PEC check
+extern int bus_priority; // SCHED_FIFO priority of the bit-bang bus worker (set before setupbus)
+extern int bus_cpu; // CPU to pin the bus worker to, -1 = any (set before setupbus)
+extern unsigned int bus_quarter; // bit-bang quarter clock period in usec (SMBus allows 3 to 25)
+extern const char *bus_trace; // bit-bang edge trace VCD files are bus_trace-N.vcd, NULL = off
+
+// Transport setup and register access
+int setupbus(const char *device); // NULL, "/dev/gpiomem", "/dev/i2c-N" or a broker socket. 0 = OK
+void setupgpio(void); // wiringPi, for programs with pins of their own. Bit-bang buses do it themselves
+int openbus(const char *device, int clock_pin, int data_pin); // same, on any pins. Bus number, -1 = failed
+void use_bus(int bus); // this thread's transactions go on this bus (openbus() picks the new one)
+void use_device(unsigned char address); // and to this device, SMBUS_BATTERY until then
+unsigned short read_word(unsigned char reg); // SMBus Read Word from the battery
+void write_word(unsigned char reg, unsigned short value); // SMBus Write Word
+int read_block(unsigned char reg, unsigned char *buf, int size); // SMBus Block Read, -1 = failed
+void set_pec(_Bool on); // send and check Packet Error Codes
+_Bool pec_probe(void); // turn PEC on if the battery supports it. error = couldn't tell, PEC left as it was
+unsigned char crc8(unsigned char crc, const unsigned char *buf, int len); // SMBus PEC
+void bus_stats(FILE *out); // bit-bang edge timing histogram and late transaction counts, this thread's bus
+void bus_trace_dump(void); // write the bit-bang edge trace to the next VCD file
+
+// Bus counters, for programs that export them (see metrics.c)
+#define SMBUS_BUCKETS 16 // log2 histograms, bucket n counts 2^(n-1) to 2^n - 1 usec
+struct smbus_counters {
+	unsigned int requests; // reads, writes and probes, any transport
+	unsigned int request_hist[SMBUS_BUCKETS]; // how long each one took to come back
+	unsigned long long request_us; // sum of those times
+	unsigned int transactions, failed, late, late_failed; // bit-bang only
+	unsigned int late_hist[SMBUS_BUCKETS]; // bit-bang edges by how late they were
+	unsigned long long late_us; // sum of those
+};
+void bus_counters(struct smbus_counters *out); // copy of this thread's bus counters so far
+
+// smbus_broker protocol, one SOCK_SEQPACKET message each way per request
+#define SMBUS_BROKER "/run/smbus_broker.sock"
+struct smbus_request {
+	char op; // 'r' read word, 'w' write word, 'b' block read, 'p' PEC probe
+	unsigned char reg;
+	unsigned short value; // word to write
+	unsigned char address; // device, ie SMBUS_BATTERY
+};
+struct smbus_reply {
+	unsigned char error; // the broker's error after the request
+	unsigned char bus_error; // and its bus_error
+	unsigned char pec; // 1 if the broker is checking PEC
+	signed char count; // block read byte count, -1 = failed
+	unsigned short value; // word read, or pec_probe() result
+	unsigned char block[32];
+};
+
+// Bit-bang primitives (also used to drive the LED and LCD pins)
+void gpio_regs(volatile unsigned int *regs, void (*sync)(int word, int wrote)); // drive pins through a GPIO register file, sync is for a fake one
+void go_z(int pin);
+void go_0(int pin);
+int read_pin(int pin);
+void startbus(void);
+void send8(char sendbits);
+void sendrptstart(void);
+int read16(void);
+void stopbus(void);
+
+#endif
@@ -0,0 +1,241 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// SMBus broker. Nothing used to stop read_battery, read_battery_loop and
+// monitor_battery from bit-banging GPIO 2/3 at the same time and
+// wrecking each other's transactions. This program owns the bus and
+// the others send it their register reads and writes over a Unix socket
+// by running with -d /run/smbus_broker.sock (see smbus.c).
+//
+// Requests are done one at a time, so writes like the Dell enable
+// sequence never land in the middle of somebody's read. A word or
+// block read that was done less than coalesce_ms ago is answered with
+// the same result without going on the bus again, so any number of
+// programs asking for the voltage costs one read. A write or a PEC probe
+// throws the recent results away since it can change what the battery
+// says. Failed reads are never reused. Each request names its device
+// (see use_device() in smbus.c), so a charger can be reached through the
+// broker too. Only battery reads are reused, and PEC is kept on or off
+// for each device address on its own.
+//
+// Any user can read through the broker. Only root can write to the
+// battery or make it probe PEC.
+//
+// kill -USR1 prints how many requests came in and how many went on the bus.
+// With -t the bit-bang edges are traced and failed transactions are
+// written out as VCD files (see smbus.c).
+//
+// Run it from a systemd unit before monitor_battery (see smbus_broker.service):
+//     sudo ./smbus_broker [-d /dev/i2c-N | -d /dev/gpiomem] [-c cpu] [-s socket] [-t /run/smbus_trace]
+// Build:
+//     gcc -o smbus_broker smbus_broker.c smbus.c -l wiringPi -l pthread
+// or against the battery simulator on a PC (see sim/fake_gpio.c):
+//     gcc -funsigned-char -I sim -o smbus_broker smbus_broker.c smbus.c sim/fake_gpio.c sim/sbs_slave.c sim/battery_model.c -l pthread -l m
+//
+// Rev 1.0 - Feb 2021 - Original release
+// Rev 1.1 - Feb 2021 - Bus edge trace option
+// Rev 1.2 - Feb 2021 - Device address in each request
+//
+#define _GNU_SOURCE // struct ucred
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "smbus.h"
+
+#define max_clients 16
+#define coalesce_ms 250 // reuse a read this recent
+
+static struct { // last good read of each register
+	struct timespec when;
+	_Bool valid;
+	struct smbus_reply reply;
+} recent_word[256], recent_block[256];
+static _Bool pec_for[128]; // PEC setting of each device address
+static unsigned int requests = 0, transactions = 0; // counters for SIGUSR1
+static volatile sig_atomic_t show_stats = 0;
+
+// Functions
+static void on_usr1(int sig)
+{
+	(void)sig;
+	show_stats = 1;
+}
+//
+static long age_ms(const struct timespec *then)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - then->tv_sec) * 1000 + (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+//
+static void forget_recent(void) // battery state may have changed
+{
+	for (int i=0; i<256; i++) {
+	  recent_word[i].valid = 0;
+	  recent_block[i].valid = 0;
+	}
+}
+//
+static void handle(const struct smbus_request *req, uid_t uid, struct smbus_reply *reply)
+{
+	memset(reply, 0, sizeof(*reply));
+	requests++;
+	unsigned char device = req->address & 0x7f;
+	use_device(device);
+	set_pec(pec_for[device]);
+	if (((req->op == 'r') || (req->op == 'b')) && (device != SMBUS_BATTERY)) { // nothing to reuse
+	  transactions++;
+	  if (req->op == 'r') reply->value = read_word(req->reg);
+	  else reply->count = read_block(req->reg, reply->block, sizeof(reply->block));
+	  reply->error = error;
+	  reply->bus_error = bus_error;
+	  reply->pec = pec;
+	  return;
+	}
+	if ((req->op == 'r') || (req->op == 'b')) {
+	  __typeof__(&recent_word[0]) recent = (req->op == 'r') ? &recent_word[req->reg] : &recent_block[req->reg];
+	  if (recent->valid && (age_ms(&recent->when) < coalesce_ms)) {
+		*reply = recent->reply; // somebody just asked for this
+		reply->pec = pec;
+		return;
+	  }
+	  transactions++;
+	  if (req->op == 'r') {
+		reply->value = read_word(req->reg);
+	  }
+	  else {
+		reply->count = read_block(req->reg, reply->block, sizeof(reply->block));
+	  }
+	  reply->error = error;
+	  reply->bus_error = bus_error;
+	  reply->pec = pec;
+	  recent->valid = !error;
+	  if (!error) {
+		recent->reply = *reply;
+		clock_gettime(CLOCK_MONOTONIC, &recent->when);
+	  }
+	  return;
+	}
+	if (uid != 0) { // writes and probes could upset the battery, root only
+	  reply->error = 1;
+	  reply->bus_error = SMBUS_FAILED;
+	  reply->pec = pec;
+	  reply->value = pec; // a refused probe leaves PEC as it was
+	  return;
+	}
+	transactions++;
+	if (req->op == 'w') {
+	  write_word(req->reg, req->value);
+	}
+	else if (req->op == 'p') {
+	  reply->value = pec_probe();
+	  pec_for[device] = pec;
+	}
+	reply->error = error;
+	reply->bus_error = bus_error;
+	reply->pec = pec;
+	forget_recent();
+}
+//
+// Main program
+int main(int argc, char *argv[])
+{
+	const char *device = SMBUS_DEVICE; // NULL = bit-bang, see smbus.h
+	const char *path = SMBUS_BROKER; // socket the programs connect to
+	int opt;
+	while ((opt = getopt(argc, argv, "d:gc:s:t:")) != -1)
+	{
+		if (opt == 'd') device = optarg; // kernel driver, ie -d /dev/i2c-1
+		else if (opt == 'g') device = NULL; // bit-bang GPIO 2/3
+		else if (opt == 'c') bus_cpu = atoi(optarg); // pin the bit-bang bus worker to this CPU
+		else if (opt == 's') path = optarg; // socket path
+		else if (opt == 't') bus_trace = optarg; // dump failed bit-bang transactions as VCD files
+		else
+		{
+			fprintf(stderr, "Usage: %s [-d /dev/i2c-N | -d /dev/gpiomem | -g] [-c cpu] [-s socket] [-t tracefile]\n", argv[0]);
+			return 1;
+		}
+	}
+	if ((device != NULL) && (strstr(device, ".sock") != NULL))
+	{
+		fprintf(stderr, "%s: the broker has to own the bus itself\n", argv[0]);
+		return 1;
+	}
+	if (setupbus(device)) return 1;
+	pec_for[SMBUS_BATTERY] = pec_probe(); // check PEC bytes from now on if the battery sends them
+	// Listening socket, anyone can connect
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	int listener = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	unlink(path); // left over from the last run
+	if ((listener < 0) || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) || listen(listener, max_clients))
+	{
+		perror(path);
+		return 1;
+	}
+	chmod(path, 0666);
+	signal(SIGUSR1, on_usr1);
+	signal(SIGPIPE, SIG_IGN); // a client that quit mid-request isn't fatal
+	struct pollfd fds[1 + max_clients];
+	uid_t uids[1 + max_clients];
+	int count = 1; // listener + clients
+	fds[0].fd = listener;
+	fds[0].events = POLLIN;
+	while (1)  // main (infinite) loop
+	{
+		if (show_stats) {
+		  fprintf(stderr, "smbus_broker: %u requests, %u bus transactions, %d clients\n",
+			requests, transactions, count - 1);
+		  show_stats = 0;
+		}
+		if (poll(fds, count, -1) < 0) continue; // signal
+		for (int i=count-1; i>0; i--) { // clients, backwards so one can be removed
+		  if (!fds[i].revents) continue;
+		  struct smbus_request req;
+		  struct smbus_reply reply;
+		  if ((fds[i].revents & POLLIN) && (recv(fds[i].fd, &req, sizeof(req), 0) == sizeof(req))) {
+			handle(&req, uids[i], &reply);
+			if (send(fds[i].fd, &reply, sizeof(reply), 0) == sizeof(reply)) continue;
+		  }
+		  close(fds[i].fd); // hung up or sent garbage
+		  fds[i] = fds[count - 1];
+		  uids[i] = uids[count - 1];
+		  count--;
+		}
+		if (fds[0].revents & POLLIN) { // new client
+		  int fd = accept(listener, NULL, NULL);
+		  if (fd < 0) continue;
+		  if (count == 1 + max_clients) {
+			close(fd); // full
+			continue;
+		  }
+		  struct ucred cred;
+		  socklen_t len = sizeof(cred);
+		  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) cred.uid = -1; // can't tell, treat as a user
+		  fds[count].fd = fd;
+		  fds[count].events = POLLIN;
+		  fds[count].revents = 0;
+		  uids[count] = cred.uid;
+		  count++;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,425 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Battery telemetry log. monitor_battery and read_battery_loop (with -l)
+// append every sample to a fixed size ring file so there is a history
+// to look at after a bad pack or a surprise shutdown. dump_telemetry
+// turns it back into CSV.
+//
+// The file is a 64 byte header followed by 8 byte records. The header
+// is only written when the file is made. Each record is written with one
+// aligned 8 byte store into a shared mmap of the file, nothing is
+// allocated and no system calls are made except an msync() every
+// sync_every stores.
+//
+// Record, byte 0 is the tag:
+//     bit 7     1 = written (an erased record is all zeros)
+//     bit 6     lap, flips each time the ring wraps around
+//     bits 5-3  0 = delta, 1 = packed deltas, 2 to 4 = keyframe part 1 to 3
+//     bits 2-0  bus retries it took to read the sample (up to 7),
+//               or for packed deltas how many samples are in it (1 to 3)
+// bytes 1-6 payload, little endian
+// byte 7    CRC-8 (same as the SMBus PEC) of bytes 0-6
+//
+// Keyframe, 3 records:
+//     part 1   seconds from the header epoch (4 bytes, signed since the
+//              Pi has no clock and can log before NTP sets the time), status (2)
+//     part 2   voltage mV (2), current mA (2), temperature 0.1 K (2)
+//     part 3   SoC (1), 5 bytes unused
+// Delta, 1 record, changes since the sample before it:
+//     seconds (1), SoC and temperature as two signed nibbles (1),
+//     voltage (2), current (2)
+// Packed deltas, 1 record, up to 3 samples one second apart with the
+// same SoC, temperature and status and no retries. Each is 2 bytes, the
+// voltage change in the top 7 bits (-64 to 63 mV) and the current change
+// in the bottom 9 (-256 to 255 mA). The record is written when its first
+// sample comes in and written again, in the same place with the same
+// single store, as the next two are added to it.
+// At 1 Hz most samples go into packed deltas. A delta is written when a
+// change won't fit in one, and a keyframe for the first sample after the
+// log is opened, every key_every records, when the status word changes,
+// or when a change won't fit in a delta either.
+//
+// Power loss. A record that was only half written when the power went
+// fails its CRC. When the log is opened again the write position is
+// found by scanning for where the lap bit changes, stepping over bad
+// records, and the next sample goes after the newest good record as a
+// keyframe. The reader
+// skips bad records and deltas that don't follow a good sample. A torn
+// record costs the samples up to the next keyframe and nothing else.
+//
+// Size. The default ring is 524288 records (4 MB). A 1 Hz log with a
+// few mV and tens of mA of noise averages 2.8 samples a record, about
+// 17 days, and still about 2 weeks with a big load step every 20
+// seconds. At monitor_battery's 5 to 60 second period it is months.
+// Pass a bigger count to telemetry_open() for longer.
+//
+// The file format needs nothing else from libsbs, so dump_telemetry
+// builds from this file alone, without the bus code or wiringPi.
+//
+// Rev 1.0 - Feb 2021 - Original release
+// Rev 1.1 - Mar 2021 - Packed deltas, and a reader that needs no libsbs
+//
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sbs.h"
+#include "telemetry.h"
+
+#define key_every 64 // records between keyframes, bounds what a bad record can lose
+#define sync_every 60 // stores between msync() calls
+#define header_size 64
+#define pack_max 3 // samples in a packed delta record
+
+// Tag bits
+#define tag_written 0x80
+#define tag_lap 0x40
+#define tag_kind 0x38 // see kind_
+#define tag_retries 0x07 // or samples in a packed delta
+enum {kind_delta, kind_packed, kind_key1, kind_key2, kind_key3}; // tag bits 5-3
+
+struct header { // first 64 bytes of the file
+	char magic[8]; // "SBSLOG2"
+	uint32_t version; // 2
+	uint32_t records; // ring size
+	int64_t epoch; // unix time the file was made, keyframe times count from here
+	uint8_t unused[header_size - 24];
+};
+
+// Writer state
+static struct header *log_file = NULL; // the whole file, mapped
+static volatile uint64_t *ring; // records, right after the header
+static unsigned int ring_size, pos; // size and next record to write
+static unsigned char lap; // lap bit for records written this time around
+static unsigned int since_key, since_sync; // records since the last keyframe, stores since the last msync
+static struct telemetry_sample last; // last sample logged
+static _Bool have_last = 0; // a delta needs a sample before it
+static unsigned char packed[8]; // packed delta record still being filled
+static int packed_at = -1; // where it is in the ring, -1 = none open
+
+// Functions
+static unsigned char record_crc(const unsigned char *buf, int len) // CRC-8, x^8 + x^2 + x + 1 (SMBus PEC), a bit at a time
+{
+	unsigned char crc = 0;
+	while (len--) {
+	  crc ^= *buf++;
+	  for (int i=0; i<8; i++) crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+	}
+	return crc;
+}
+//
+static _Bool good_record(const unsigned char r[8])
+{
+	return (r[0] & tag_written) && (record_crc(r, 7) == r[7]);
+}
+//
+static unsigned int find_end(const unsigned char *recs, unsigned int n, unsigned char *lap_now) // index after the newest record
+{
+	// Records 0 up to the write position have the lap bit of the first good
+	// record, the ones after it (if the ring has wrapped) have the other
+	// one. Bad records in between, ie torn by a power loss, are stepped over.
+	unsigned int end = 0;
+	int first_lap = -1;
+	for (unsigned int i=0; i<n; i++) {
+	  const unsigned char *r = recs + i * 8;
+	  if (!good_record(r)) continue;
+	  int l = (r[0] & tag_lap) != 0;
+	  if (first_lap < 0) first_lap = l;
+	  if (l != first_lap) break; // older lap from here on
+	  end = i + 1;
+	}
+	*lap_now = (first_lap > 0);
+	return end;
+}
+//
+static void store(unsigned char r[8], unsigned int at) // CRC the record and write it to the ring
+{
+	uint64_t word;
+	r[7] = record_crc(r, 7);
+	memcpy(&word, r, 8);
+	ring[at] = word; // one store, half a record can only come from power loss
+	if (++since_sync >= sync_every) {
+	  msync(log_file, header_size + ring_size * 8, MS_ASYNC); // let the kernel start writing it out
+	  since_sync = 0;
+	}
+}
+//
+static void put(unsigned char r[8]) // fill in tag bits, then store the record at the write position
+{
+	r[0] |= tag_written | (lap ? tag_lap : 0);
+	store(r, pos);
+	if (++pos == ring_size) {
+	  pos = 0;
+	  lap ^= 1;
+	}
+}
+//
+static void put16(unsigned char *p, unsigned short v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+//
+static unsigned short get16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+//
+static void put_key(const struct telemetry_sample *s, int64_t epoch)
+{
+	unsigned char r[8] = {0};
+	uint32_t t = (int32_t)(s->when - epoch);
+	r[0] = (kind_key1 << 3) | s->retries;
+	r[1] = t & 0xff;
+	r[2] = (t >> 8) & 0xff;
+	r[3] = (t >> 16) & 0xff;
+	r[4] = t >> 24;
+	put16(&r[5], s->status);
+	put(r);
+	memset(r, 0, sizeof(r));
+	r[0] = (kind_key2 << 3) | s->retries;
+	put16(&r[1], s->voltage);
+	put16(&r[3], s->current);
+	put16(&r[5], s->temperature);
+	put(r);
+	memset(r, 0, sizeof(r));
+	r[0] = (kind_key3 << 3) | s->retries;
+	r[1] = s->soc;
+	put(r);
+	since_key = 0;
+	packed_at = -1;
+}
+//
+static _Bool put_packed(const struct telemetry_sample *s) // 0 if the sample can't go in a packed delta
+{
+	int dv = s->voltage - last.voltage;
+	int di = s->current - last.current;
+	if ((s->when - last.when != 1) || (s->soc != last.soc) || (s->temperature != last.temperature) || s->retries) return 0;
+	if ((dv < -64) || (dv > 63) || (di < -256) || (di > 255)) return 0;
+	unsigned short slot = ((dv & 0x7f) << 9) | (di & 0x1ff);
+	int n = (packed_at >= 0) ? (packed[0] & tag_retries) : pack_max;
+	if (n < pack_max) { // room in the open one, write it again with one more
+	  put16(&packed[1 + n * 2], slot);
+	  packed[0] = (packed[0] & ~tag_retries) | (n + 1);
+	  store(packed, packed_at);
+	  return 1;
+	}
+	memset(packed, 0, sizeof(packed));
+	packed[0] = (kind_packed << 3) | 1;
+	put16(&packed[1], slot);
+	packed_at = pos;
+	put(packed); // leaves the tag bits and CRC in packed for the next rewrite
+	since_key++;
+	return 1;
+}
+//
+static _Bool put_delta(const struct telemetry_sample *s) // 0 if the changes don't fit in a delta
+{
+	long dt = s->when - last.when;
+	int dsoc = s->soc - last.soc;
+	int dtemp = s->temperature - last.temperature;
+	int dv = s->voltage - last.voltage;
+	int di = s->current - last.current;
+	if ((dt < 0) || (dt > 255)) return 0;
+	if ((dsoc < -8) || (dsoc > 7) || (dtemp < -8) || (dtemp > 7)) return 0;
+	if ((dv < -32768) || (dv > 32767) || (di < -32768) || (di > 32767)) return 0;
+	unsigned char r[8] = {0};
+	r[0] = (kind_delta << 3) | s->retries;
+	r[1] = dt;
+	r[2] = ((dsoc & 0x0f) << 4) | (dtemp & 0x0f);
+	put16(&r[3], dv);
+	put16(&r[5], di);
+	put(r);
+	since_key++;
+	packed_at = -1;
+	return 1;
+}
+//
+int telemetry_open(const char *path, unsigned int records)
+{
+	if (records < key_every) records = telemetry_records;
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+	{
+		perror(path);
+		return -1;
+	}
+	struct stat st;
+	fstat(fd, &st);
+	_Bool fresh = (st.st_size < header_size); // new (or empty) file
+	if (!fresh) { // keep the size the file was made with
+	  struct header h;
+	  if ((pread(fd, &h, sizeof(h), 0) != sizeof(h)) || memcmp(h.magic, "SBSLOG2", 8) ||
+	     (st.st_size != header_size + (off_t)h.records * 8))
+	  {
+		fprintf(stderr, "%s: not a telemetry log (or an old format one)\n", path);
+		close(fd);
+		return -1;
+	  }
+	  records = h.records;
+	}
+	else if (ftruncate(fd, header_size + (off_t)records * 8)) // erased records read as zeros
+	{
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	void *map = mmap(NULL, header_size + (size_t)records * 8, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd); // the mapping stays valid
+	if (map == MAP_FAILED)
+	{
+		perror("mmap");
+		return -1;
+	}
+	log_file = map;
+	ring = (volatile uint64_t *)((char *)map + header_size);
+	ring_size = records;
+	if (fresh) {
+	  struct header h = {"SBSLOG2", 2, records, time(NULL), {0}};
+	  memcpy(log_file, &h, sizeof(h));
+	  msync(log_file, header_size, MS_SYNC);
+	}
+	pos = find_end((const unsigned char *)ring, ring_size, &lap); // carry on after the newest record
+	if (pos == ring_size) { // full lap, start the next one
+	  pos = 0;
+	  lap ^= 1;
+	}
+	have_last = 0; // first sample is a keyframe
+	packed_at = -1;
+	since_sync = 0;
+	return 0;
+}
+//
+void telemetry_log(const struct sbs_snapshot *snap) // battery has to have answered
+{
+	if (!log_file || !(snap->valid & SBS_STATUS)) return;
+	struct telemetry_sample s = last; // a field that didn't read keeps its last value
+	s.when = snap->when.tv_sec;
+	s.status = snap->status;
+	if (snap->valid & SBS_VOLTAGE) s.voltage = snap->voltage;
+	if (snap->valid & SBS_CURRENT) s.current = snap->current;
+	if (snap->valid & SBS_TEMPERATURE) s.temperature = snap->temperature;
+	if (snap->valid & SBS_SOC) s.soc = snap->soc;
+	s.retries = (snap->retries > tag_retries) ? tag_retries : snap->retries;
+	if (!have_last || (since_key >= key_every) || (s.status != last.status) ||
+	   (!put_packed(&s) && !put_delta(&s))) {
+	  put_key(&s, log_file->epoch);
+	}
+	last = s;
+	have_last = 1;
+}
+//
+void telemetry_close(void)
+{
+	if (!log_file) return;
+	msync(log_file, header_size + ring_size * 8, MS_SYNC);
+	munmap(log_file, header_size + ring_size * 8);
+	log_file = NULL;
+}
+//
+int telemetry_read(const char *path, int (*each)(const struct telemetry_sample *sample, void *arg), void *arg)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		perror(path);
+		return -1;
+	}
+	struct stat st;
+	struct header h;
+	fstat(fd, &st);
+	if ((pread(fd, &h, sizeof(h), 0) != sizeof(h)) || memcmp(h.magic, "SBSLOG2", 8) ||
+	   (st.st_size != header_size + (off_t)h.records * 8))
+	{
+		fprintf(stderr, "%s: not a telemetry log (or an old format one)\n", path);
+		close(fd);
+		return -1;
+	}
+	const unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		perror("mmap");
+		return -1;
+	}
+	const unsigned char *recs = map + header_size;
+	// Oldest record is the one after the newest. If the ring hasn't
+	// wrapped yet everything from there on is erased and gets skipped.
+	unsigned int n = h.records;
+	unsigned char lap0;
+	unsigned int start = find_end(recs, n, &lap0) % n;
+	struct telemetry_sample s = {0};
+	int count = 0;
+	int part = 0; // keyframe parts read so far
+	_Bool have = 0; // s holds a good sample for the next delta
+	for (unsigned int k=0; k<n; k++) {
+	  const unsigned char *r = recs + ((start + k) % n) * 8;
+	  int kind = (r[0] & tag_kind) >> 3;
+	  int low = r[0] & tag_retries;
+	  _Bool key = (kind >= kind_key1);
+	  if (!good_record(r) || (kind > kind_key3) || (key && (kind - kind_key1 != part)) ||
+	     (!key && (!have || part)) || ((kind == kind_packed) && (low == 0))) {
+		have = 0; // erased, torn or out of order, wait for the next keyframe
+		part = 0;
+		continue;
+	  }
+	  if (kind == kind_key1) {
+		s.when = h.epoch + (int32_t)(r[1] | (r[2] << 8) | (r[3] << 16) | ((uint32_t)r[4] << 24));
+		s.status = get16(&r[5]);
+		part = 1;
+		have = 0;
+		continue;
+	  }
+	  if (kind == kind_key2) {
+		s.voltage = get16(&r[1]);
+		s.current = get16(&r[3]);
+		s.temperature = get16(&r[5]);
+		part = 2;
+		continue;
+	  }
+	  if (kind == kind_packed) { // 1 to 3 samples a second apart
+		_Bool stop = 0;
+		for (int i=0; (i<low) && !stop; i++) {
+		  short slot = get16(&r[1 + i * 2]);
+		  s.when++;
+		  s.voltage += slot >> 9; // top 7 bits, sign extended
+		  s.current += (short)(slot << 7) >> 7; // bottom 9 bits
+		  s.retries = 0;
+		  count++;
+		  stop = each(&s, arg);
+		}
+		if (stop) break;
+		continue;
+	  }
+	  if (kind == kind_key3) { // last part of the keyframe
+		s.soc = r[1];
+		part = 0;
+		have = 1;
+	  }
+	  else { // delta
+		s.when += r[1];
+		s.soc += (signed char)(r[2] & 0xf0) >> 4; // sign extend the nibbles
+		s.temperature += (signed char)(r[2] << 4) >> 4;
+		s.voltage += (short)get16(&r[3]);
+		s.current += (short)get16(&r[5]);
+	  }
+	  s.retries = low;
+	  count++;
+	  if (each(&s, arg)) break;
+	}
+	munmap((void *)map, st.st_size);
+	return count;
+}
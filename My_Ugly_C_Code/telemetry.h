@@ -0,0 +1,47 @@
+/* Copyright 2021 Frank Adams
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+// Battery telemetry log, a fixed size ring file of 8 byte records.
+// See telemetry.c for the file format. Reading it only needs
+// telemetry.c, not the rest of libsbs.
+//
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <time.h>
+#include "sbs.h"
+
+#define telemetry_records 524288 // default ring size, 4 MB of records, about 2 to 3 weeks at 1 Hz
+
+// One decoded sample
+struct telemetry_sample {
+	time_t when; // unix time, 1 second resolution
+	unsigned short voltage; // mV
+	short current; // mA, negative = discharging
+	unsigned short temperature; // 0.1 K
+	unsigned char soc; // percent
+	unsigned short status; // battery status word
+	unsigned char retries; // bus retries it took to read this sample (7 = 7 or more)
+};
+
+// Writer, one log per program
+int telemetry_open(const char *path, unsigned int records); // creates the file if needed. 0 = OK
+void telemetry_log(const struct sbs_snapshot *snap); // append a sample, no-op if the log isn't open
+void telemetry_close(void);
+
+// Reader, calls each() for every sample from oldest to newest. Stops
+// early if each() returns non 0. Returns # of samples, -1 = bad file
+int telemetry_read(const char *path, int (*each)(const struct telemetry_sample *sample, void *arg), void *arg);
+
+#endif